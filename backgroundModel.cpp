@@ -0,0 +1,121 @@
+/*
+  Nihal Sandadi
+
+  Background model segmentation. The camera always looks at the same white
+  surface, so instead of one global threshold per frame each pixel is compared
+  against its own learned background, which also absorbs vignetting and
+  uneven lighting.
+*/
+
+#include "backgroundModel.h"
+#include "thresholding.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+/*
+  model : background model to clear
+
+  Drops the learned background so the next frames are learned again.
+*/
+void resetBackgroundModel(BackgroundModel& model) {
+    model.mean.release();
+    model.variance.release();
+    model.framesLearned = 0;
+}
+
+/*
+  model : background model to check
+
+  Whether the learning frames are done and frames are being classified.
+*/
+bool isBackgroundLearned(const BackgroundModel& model) {
+    return !model.mean.empty() && model.framesLearned >= model.learningFrames;
+}
+
+/*
+  frame : color frame from video capture
+  model : background model, learned or updated in place
+  mask : output packed mask
+
+  While learning, accumulates the per-pixel mean and variance (Welford) and
+  returns an all background mask. Afterwards every pixel further than
+  foregroundSigma standard deviations from its mean is foreground (unset, dark
+  like the objects in the other modes) and the rest is background (set), which
+  also nudges the background statistics by learningRate.
+*/
+void backgroundThreshold(const Mat& frame, BackgroundModel& model, BinaryMask& mask) {
+    Mat blurred;
+    BinaryMask unused;
+    vector<int> histogram;
+    fusedValueBlur(frame, VALUE_GRAY, -1, blurred, unused, histogram);
+
+    if (model.mean.size() != blurred.size()) {
+        resetBackgroundModel(model);
+        model.mean = Mat::zeros(blurred.size(), CV_32F);
+        model.variance = Mat::zeros(blurred.size(), CV_32F);
+    }
+
+    mask.create(blurred.rows, blurred.cols);
+
+    if (model.framesLearned < model.learningFrames) {
+        float n = static_cast<float>(model.framesLearned + 1);
+        parallel_for_(Range(0, blurred.rows), [&](const Range& range) {
+            for (int y = range.start; y < range.end; y++) {
+                const uchar* src = blurred.ptr<uchar>(y);
+                float* mean = model.mean.ptr<float>(y);
+                float* variance = model.variance.ptr<float>(y);
+                for (int x = 0; x < blurred.cols; x++) {
+                    float delta = src[x] - mean[x];
+                    mean[x] += delta / n;
+                    variance[x] += (delta * (src[x] - mean[x]) - variance[x]) / n;
+                }
+            }
+        });
+        model.framesLearned++;
+        mask.setAll(true);
+        return;
+    }
+
+    float sigma2 = model.foregroundSigma * model.foregroundSigma;
+    float minVariance = model.minVariance;
+    float rate = model.learningRate;
+
+    parallel_for_(Range(0, blurred.rows), [&](const Range& range) {
+        vector<uchar> rowValues(blurred.cols);
+        for (int y = range.start; y < range.end; y++) {
+            const uchar* src = blurred.ptr<uchar>(y);
+            float* mean = model.mean.ptr<float>(y);
+            float* variance = model.variance.ptr<float>(y);
+            uchar* dst = rowValues.data();
+            // branch free selects so the row loop vectorizes
+            for (int x = 0; x < blurred.cols; x++) {
+                float delta = src[x] - mean[x];
+                float delta2 = delta * delta;
+                bool foreground = delta2 > sigma2 * max(variance[x], minVariance);
+                float alpha = foreground ? 0.0f : rate;
+                dst[x] = foreground ? 0 : 255;
+                mean[x] += alpha * delta;
+                variance[x] += alpha * (delta2 - variance[x]);
+            }
+            mask.packRow(y, dst, 0);
+        }
+    });
+}
+
+/*
+  frame : color frame from video capture
+  model : background model, learned or updated in place
+
+  8-bit version of backgroundThreshold above, background 255 and foreground 0.
+*/
+Mat backgroundThreshold(const Mat& frame, BackgroundModel& model) {
+    BinaryMask mask;
+    Mat result;
+    backgroundThreshold(frame, model, mask);
+    mask.toMat(result);
+    return result;
+}
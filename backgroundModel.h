@@ -0,0 +1,34 @@
+/*
+  Nihal Sandadi
+
+  Header file for background model segmentation, learning the fixed white
+  background per pixel and thresholding each frame against it.
+*/
+
+#ifndef BACKGROUND_MODEL_H
+#define BACKGROUND_MODEL_H
+
+#include <opencv2/opencv.hpp>
+#include "binaryMask.h"
+
+/*
+  Per-pixel running mean and variance of the blurred gray background, learned
+  over the first learningFrames frames and then slowly adapted on pixels
+  classified as background.
+*/
+struct BackgroundModel {
+    cv::Mat mean;
+    cv::Mat variance;
+    int framesLearned = 0;
+    int learningFrames = 30;
+    float learningRate = 0.01f;
+    float foregroundSigma = 3.0f;
+    float minVariance = 9.0f;
+};
+
+void resetBackgroundModel(BackgroundModel& model);
+bool isBackgroundLearned(const BackgroundModel& model);
+void backgroundThreshold(const cv::Mat& frame, BackgroundModel& model, BinaryMask& mask);
+cv::Mat backgroundThreshold(const cv::Mat& frame, BackgroundModel& model);
+
+#endif
@@ -0,0 +1,316 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the bit-packed binary mask: packing, inversion, display
+  conversion and run based connected component labeling.
+*/
+
+#include "binaryMask.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+BinaryMask::BinaryMask() : nRows(0), nCols(0), nWords(0) {
+}
+
+BinaryMask::BinaryMask(int rows, int cols) : nRows(0), nCols(0), nWords(0) {
+    create(rows, cols);
+}
+
+/*
+  rows, cols : mask size in pixels
+
+  Sizes the mask, keeping the existing storage when the size is unchanged.
+  Contents are unspecified afterwards.
+*/
+void BinaryMask::create(int rows, int cols) {
+    if (rows == nRows && cols == nCols) return;
+    nRows = rows;
+    nCols = cols;
+    nWords = (cols + 63) / 64;
+    bits.assign(static_cast<size_t>(nRows) * nWords, 0);
+}
+
+/*
+  Bits of the last word of each row that are inside the image.
+*/
+uint64_t BinaryMask::tailMask() const {
+    int used = nCols - (nWords - 1) * 64;
+    return used >= 64 ? ~0ULL : ((1ULL << used) - 1);
+}
+
+/*
+  value : value to set every pixel to
+*/
+void BinaryMask::setAll(bool value) {
+    uint64_t fill = value ? ~0ULL : 0ULL;
+    uint64_t tail = tailMask();
+    for (int y = 0; y < nRows; y++) {
+        uint64_t* words = row(y);
+        for (int w = 0; w < nWords; w++) words[w] = fill;
+        words[nWords - 1] &= tail;
+    }
+}
+
+/*
+  y : row to write
+  values : one 8-bit value per pixel
+  threshold : pixels with values above it are set
+
+  Packs one row of 8-bit values into bits, 64 comparisons per stored word.
+*/
+void BinaryMask::packRow(int y, const uchar* values, int threshold) {
+    uint64_t* words = row(y);
+    for (int w = 0; w < nWords; w++) {
+        const uchar* v = values + w * 64;
+        int count = min(64, nCols - w * 64);
+        uint64_t word = 0;
+        for (int i = 0; i < count; i++) {
+            word |= static_cast<uint64_t>(v[i] > threshold) << i;
+        }
+        words[w] = word;
+    }
+}
+
+/*
+  dst : output mask, may be this mask
+
+  Word-wise NOT, with the bits past the last column cleared again.
+*/
+void BinaryMask::invert(BinaryMask& dst) const {
+    dst.create(nRows, nCols);
+    uint64_t tail = tailMask();
+    for (int y = 0; y < nRows; y++) {
+        const uint64_t* src = row(y);
+        uint64_t* out = dst.row(y);
+        for (int w = 0; w < nWords; w++) out[w] = ~src[w];
+        out[nWords - 1] &= tail;
+    }
+}
+
+/*
+  src : 8-bit single channel binary image, nonzero pixels are set
+*/
+void BinaryMask::fromMat(const Mat& src) {
+    CV_Assert(src.type() == CV_8UC1);
+    create(src.rows, src.cols);
+    for (int y = 0; y < nRows; y++) {
+        packRow(y, src.ptr<uchar>(y), 0);
+    }
+}
+
+/*
+  dst : output 8-bit image, 255 for set pixels and 0 otherwise
+
+  Expands the mask for display.
+*/
+void BinaryMask::toMat(Mat& dst) const {
+    dst.create(nRows, nCols, CV_8UC1);
+    for (int y = 0; y < nRows; y++) {
+        const uint64_t* words = row(y);
+        uchar* out = dst.ptr<uchar>(y);
+        for (int x = 0; x < nCols; x++) {
+            out[x] = ((words[x >> 6] >> (x & 63)) & 1) ? 255 : 0;
+        }
+    }
+}
+
+/*
+  word : nonzero 64-bit word
+
+  Index of the lowest set bit.
+*/
+int countTrailingZeros(uint64_t word) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+/*
+  Horizontal run of set pixels [start, end) in one row.
+*/
+struct PixelRun {
+    int row;
+    int start;
+    int end;
+    int parent;
+};
+
+/*
+  runs : all runs so far
+  i : run index
+
+  Union-find root with path halving.
+*/
+static int findRoot(vector<PixelRun>& runs, int i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+/*
+  end : number of terms
+
+  Sums of x, x^2 and x^3 for x = 0 .. end - 1, so the sums over a run
+  [start, end) are differences of two of these.
+*/
+static double sumPowers1(double end) { return end * (end - 1) / 2.0; }
+static double sumPowers2(double end) { return (end - 1) * end * (2 * end - 1) / 6.0; }
+static double sumPowers3(double end) { double s1 = sumPowers1(end); return s1 * s1; }
+
+/*
+  mask : mask whose set pixels are labeled
+  labels : output CV_32S label image, 0 for unset pixels
+  stats : output numLabels x 5 CV_32S, same layout as connectedComponentsWithStats
+  centroids : output numLabels x 2 CV_64F component centroids
+  moments : optional output, per label moments (index 0 unused) equal to
+    cv::moments of that component's mask
+
+  8-connected component labeling directly on the packed bits. Runs of set
+  pixels are found a word at a time with bit scans, runs on consecutive rows
+  that touch (including diagonally) are merged with union-find, and labels
+  are numbered in raster order of each component's first pixel. The raw
+  moments up to third order are summed per run in closed form in the same
+  sweep, so every component's moments cost O(runs) rather than a scan of
+  the frame per component. Returns the number of labels including the
+  background.
+*/
+int labelComponents(const BinaryMask& mask, Mat& labels, Mat& stats, Mat& centroids,
+    vector<Moments>* moments) {
+    int rows = mask.rows(), cols = mask.cols(), nWords = mask.wordsPerRow();
+    vector<PixelRun> runs;
+    runs.reserve(rows * 4);
+    int prevStart = 0, prevEnd = 0;
+
+    for (int y = 0; y < rows; y++) {
+        const uint64_t* words = mask.row(y);
+        int rowStart = static_cast<int>(runs.size());
+        int x = 0;
+        while (x < cols) {
+            int w = x >> 6;
+            uint64_t word = words[w] & (~0ULL << (x & 63));
+            while (word == 0 && ++w < nWords) word = words[w];
+            if (w >= nWords) break;
+            int start = w * 64 + countTrailingZeros(word);
+
+            w = start >> 6;
+            word = ~words[w] & (~0ULL << (start & 63));
+            while (word == 0 && ++w < nWords) word = ~words[w];
+            int end = (w >= nWords) ? cols : min(cols, w * 64 + countTrailingZeros(word));
+
+            int index = static_cast<int>(runs.size());
+            runs.push_back({ y, start, end, index });
+
+            // merge with every run on the previous row it touches
+            while (prevStart < prevEnd && runs[prevStart].end < start) prevStart++;
+            for (int p = prevStart; p < prevEnd && runs[p].start <= end; p++) {
+                int a = findRoot(runs, p), b = findRoot(runs, index);
+                if (a != b) {
+                    runs[max(a, b)].parent = min(a, b);
+                }
+            }
+            x = end;
+        }
+        prevStart = rowStart;
+        prevEnd = static_cast<int>(runs.size());
+    }
+
+    vector<int> runLabel(runs.size());
+    int numLabels = 1;
+    for (size_t i = 0; i < runs.size(); i++) {
+        int root = findRoot(runs, static_cast<int>(i));
+        runLabel[i] = (root == static_cast<int>(i)) ? numLabels++ : runLabel[root];
+    }
+
+    labels.create(rows, cols, CV_32S);
+    labels.setTo(Scalar(0));
+    stats.create(numLabels, 5, CV_32S);
+    centroids.create(numLabels, 2, CV_64F);
+    vector<int> minX(numLabels, cols), minY(numLabels, rows), maxX(numLabels, -1), maxY(numLabels, -1);
+    vector<int64> area(numLabels, 0);
+    vector<double> sumX(numLabels, 0.0), sumY(numLabels, 0.0);
+    // raw moments m20, m11, m02, m30, m21, m12, m03 per label
+    vector<double> raw(moments ? numLabels * 7 : 0, 0.0);
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        const PixelRun& run = runs[i];
+        int label = runLabel[i];
+        int* out = labels.ptr<int>(run.row);
+        for (int x = run.start; x < run.end; x++) out[x] = label;
+
+        int length = run.end - run.start;
+        area[label] += length;
+        sumX[label] += 0.5 * (run.start + run.end - 1) * length;
+        sumY[label] += static_cast<double>(run.row) * length;
+        minX[label] = min(minX[label], run.start);
+        maxX[label] = max(maxX[label], run.end - 1);
+        minY[label] = min(minY[label], run.row);
+        maxY[label] = max(maxY[label], run.row);
+
+        if (moments) {
+            double y = run.row;
+            double s1 = sumPowers1(run.end) - sumPowers1(run.start);
+            double s2 = sumPowers2(run.end) - sumPowers2(run.start);
+            double s3 = sumPowers3(run.end) - sumPowers3(run.start);
+            double* m = &raw[label * 7];
+            m[0] += s2;
+            m[1] += y * s1;
+            m[2] += y * y * length;
+            m[3] += s3;
+            m[4] += y * s2;
+            m[5] += y * y * s1;
+            m[6] += y * y * y * length;
+        }
+    }
+
+    if (moments) {
+        moments->assign(numLabels, Moments());
+        for (int label = 1; label < numLabels; label++) {
+            const double* m = &raw[label * 7];
+            (*moments)[label] = Moments(static_cast<double>(area[label]), sumX[label], sumY[label],
+                m[0], m[1], m[2], m[3], m[4], m[5], m[6]);
+        }
+    }
+
+    // background row: area and centroid of the unset pixels, bounding box of the whole image
+    int64 background = static_cast<int64>(rows) * cols;
+    double backgroundX = 0.5 * (cols - 1) * background, backgroundY = 0.5 * (rows - 1) * background;
+    for (int label = 1; label < numLabels; label++) {
+        background -= area[label];
+        backgroundX -= sumX[label];
+        backgroundY -= sumY[label];
+    }
+    area[0] = background;
+    sumX[0] = backgroundX;
+    sumY[0] = backgroundY;
+    minX[0] = 0;
+    minY[0] = 0;
+    maxX[0] = cols - 1;
+    maxY[0] = rows - 1;
+
+    for (int label = 0; label < numLabels; label++) {
+        int* s = stats.ptr<int>(label);
+        s[CC_STAT_LEFT] = minX[label];
+        s[CC_STAT_TOP] = minY[label];
+        s[CC_STAT_WIDTH] = maxX[label] - minX[label] + 1;
+        s[CC_STAT_HEIGHT] = maxY[label] - minY[label] + 1;
+        s[CC_STAT_AREA] = static_cast<int>(area[label]);
+        double* c = centroids.ptr<double>(label);
+        c[0] = area[label] > 0 ? sumX[label] / area[label] : 0.0;
+        c[1] = area[label] > 0 ? sumY[label] / area[label] : 0.0;
+    }
+
+    return numLabels;
+}
@@ -0,0 +1,53 @@
+/*
+  Nihal Sandadi
+
+  Header file for the bit-packed binary mask used through thresholding,
+  morphology and labeling, with conversion to cv::Mat only for display.
+*/
+
+#ifndef BINARY_MASK_H
+#define BINARY_MASK_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cstdint>
+
+/*
+  Binary image at 1 bit per pixel, 64 pixels per word. Pixel x of a row is
+  bit x % 64 of word x / 64, so the leftmost pixel is the lowest bit. Bits
+  past the last column are always kept at 0.
+*/
+class BinaryMask {
+public:
+    BinaryMask();
+    BinaryMask(int rows, int cols);
+    void create(int rows, int cols);
+
+    int rows() const { return nRows; }
+    int cols() const { return nCols; }
+    int wordsPerRow() const { return nWords; }
+    cv::Size size() const { return cv::Size(nCols, nRows); }
+    bool empty() const { return nRows == 0 || nCols == 0; }
+    uint64_t* row(int y) { return bits.data() + static_cast<size_t>(y) * nWords; }
+    const uint64_t* row(int y) const { return bits.data() + static_cast<size_t>(y) * nWords; }
+    bool get(int y, int x) const { return (row(y)[x >> 6] >> (x & 63)) & 1; }
+    uint64_t tailMask() const;
+
+    void setAll(bool value);
+    void packRow(int y, const uchar* values, int threshold);
+    void invert(BinaryMask& dst) const;
+    void fromMat(const cv::Mat& src);
+    void toMat(cv::Mat& dst) const;
+
+private:
+    int nRows;
+    int nCols;
+    int nWords;
+    std::vector<uint64_t> bits;
+};
+
+int countTrailingZeros(uint64_t word);
+int labelComponents(const BinaryMask& mask, cv::Mat& labels, cv::Mat& stats, cv::Mat& centroids,
+    std::vector<cv::Moments>* moments = nullptr);
+
+#endif
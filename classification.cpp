@@ -6,12 +6,101 @@
 */
 
 #include "classification.h"
+#include "distanceKernels.h"
+#include "featureTree.h"
 #include <algorithm>
 #include <limits>
 #include <cmath>
 
 using namespace std;
 
+// classic feature weights, hu moment counts double
+static const double classicWeights[ClassicModel::featureCount] = { 1.0, 1.0, 1.0, 2.0 };
+
+/*
+  model : model whose statistics just changed
+
+  Recomputes each feature's scale from the running statistics and rescales
+  the stored samples from their raw features to match. Spreads under 0.001,
+  and every spread while there is only one sample, count as 1 so those
+  features aren't blown up.
+*/
+static void rescaleClassicModel(ClassicModel& model) {
+    const int n = ClassicModel::featureCount;
+    for (int i = 0; i < n; i++) {
+        double stdDev = (model.count > 1) ? sqrt(model.sumSquares[i] / model.count) : 1.0;
+        if (stdDev < 0.001) stdDev = 1.0;
+        model.scale[i] = sqrt(classicWeights[i]) / stdDev;
+    }
+
+    model.scaledFeatures.resize(model.rawFeatures.size());
+    for (size_t k = 0; k < model.rawFeatures.size(); k++) {
+        model.scaledFeatures[k] = model.rawFeatures[k] * model.scale[k % n];
+    }
+}
+
+/*
+  model : model to extend
+  sample : new training sample, its first featureCount features are used
+
+  Welford update of the feature means and spreads with the sample, and
+  appends its raw features, label and label id, registering the label if it
+  is new. The stored rows are not rescaled, callers do that once they have
+  added everything. Returns false for a sample without the full set of
+  classic features, which is skipped.
+*/
+static bool appendClassicSample(ClassicModel& model, const TrainingSample& sample) {
+    const int n = ClassicModel::featureCount;
+    if (sample.features.size() < n) {
+        return false;
+    }
+
+    model.count++;
+    for (int i = 0; i < n; i++) {
+        double x = sample.features[i];
+        double delta = x - model.mean[i];
+        model.mean[i] += delta / model.count;
+        model.sumSquares[i] += delta * (x - model.mean[i]);
+    }
+
+    model.rawFeatures.insert(model.rawFeatures.end(), sample.features.begin(), sample.features.begin() + n);
+    model.labels.push_back(sample.label);
+    auto name = find(model.labelNames.begin(), model.labelNames.end(), sample.label);
+    model.labelIds.push_back(static_cast<int>(name - model.labelNames.begin()));
+    if (name == model.labelNames.end()) {
+        model.labelNames.push_back(sample.label);
+    }
+    return true;
+}
+
+/*
+  model : model to fill
+  trainingData : collection of training samples
+
+  Compiles the training set into the model, replacing whatever it held. The
+  rows are scaled once at the end, so building is linear in the samples.
+*/
+void buildClassicModel(ClassicModel& model, const vector<TrainingSample>& trainingData) {
+    model = ClassicModel();
+    for (const auto& sample : trainingData) {
+        appendClassicSample(model, sample);
+    }
+    rescaleClassicModel(model);
+}
+
+/*
+  model : model to extend
+  sample : new training sample, its first featureCount features are used
+
+  Adds one sample, then rescales the stored samples to the new spreads.
+  Samples without the full set of classic features are skipped.
+*/
+void addToClassicModel(ClassicModel& model, const TrainingSample& sample) {
+    if (appendClassicSample(model, sample)) {
+        rescaleClassicModel(model);
+    }
+}
+
 /*
   features : vector of 4 classic features from region analysis
   trainingData : collection of training samples for comparison
@@ -22,63 +111,163 @@ using namespace std;
 ClassificationResult classifyObject(const vector<double>& features,
     const vector<TrainingSample>& trainingData,
     double distanceThreshold) {
+    ClassicModel model;
+    buildClassicModel(model, trainingData);
+    return classifyObject(features, model, distanceThreshold);
+}
+
+/*
+  features : vector of 4 classic features from region analysis
+  model : compiled training set
+  distanceThreshold : maximum allowed distance
+
+  Same as above against a compiled model: the query is scaled once and the
+  nearest sample found in one pass over the stored rows.
+*/
+ClassificationResult classifyObject(const vector<double>& features,
+    const ClassicModel& model,
+    double distanceThreshold) {
+    const int n = ClassicModel::featureCount;
+    static_assert(n == 4, "the distance loop is unrolled for four features");
     ClassificationResult result;
     result.isUnknown = true;
     result.distance = numeric_limits<double>::max();
 
-    if (trainingData.empty() || features.empty()) {
+    const int rows = static_cast<int>(model.labels.size());
+    if (rows == 0 || features.size() < n) {
         result.label = "Unknown";
         return result;
     }
 
-    vector<double> stdDevs(features.size(), 1.0);
-
-    if (trainingData.size() > 1) {
-        for (size_t i = 0; i < features.size(); i++) {
-            double mean = 0.0;
-            for (const auto& sample : trainingData) {
-                mean += sample.features[i];
-            }
-            mean /= trainingData.size();
-
-            double variance = 0.0;
-            for (const auto& sample : trainingData) {
-                variance += pow(sample.features[i] - mean, 2);
-            }
-            variance /= trainingData.size();
-            stdDevs[i] = sqrt(variance);
+    double query[n];
+    for (int i = 0; i < n; i++) {
+        query[i] = features[i] * model.scale[i];
+    }
 
-            if (stdDevs[i] < 0.001) stdDevs[i] = 1.0;
+    double minSquared = numeric_limits<double>::max();
+    int best = -1;
+    const double* row = model.scaledFeatures.data();
+    for (int s = 0; s < rows; s++, row += n) {
+        double d0 = query[0] - row[0];
+        double d1 = query[1] - row[1];
+        double d2 = query[2] - row[2];
+        double d3 = query[3] - row[3];
+        double squared = d0 * d0 + d1 * d1 + d2 * d2 + d3 * d3;
+        if (squared < minSquared) {
+            minSquared = squared;
+            best = s;
         }
     }
 
-    vector<double> weights = { 1.0, 1.0, 1.0, 2.0 };
+    double minDistance = sqrt(minSquared);
+    double adjustedThreshold = distanceThreshold * 1.5;
 
-    double minDistance = numeric_limits<double>::max();
-    string bestLabel = "Unknown";
+    result.label = model.labels[best];
+    result.distance = minDistance;
+    result.isUnknown = (minDistance > adjustedThreshold);
 
-    for (const auto& sample : trainingData) {
-        double distance = 0.0;
+    return result;
+}
 
-        for (size_t i = 0; i < features.size(); i++) {
-            double diff = (features[i] - sample.features[i]) / stdDevs[i];
-            distance += weights[i] * diff * diff;
-        }
-        distance = sqrt(distance);
+/*
+  features : vector of 4 classic features from region analysis
+  model : compiled training set
+  tree : tree over the model's rows, up to date with syncFeatureTree
+  distanceThreshold : maximum allowed distance
+  minMargin : smallest gap between the best and second best label's distances the classic result is trusted with
+  candidateCount : most labels passed on to the CNN
 
-        if (distance < minDistance) {
-            minDistance = distance;
-            bestLabel = sample.label;
-        }
+  First stage of the cascade. Finds the nearest sample of the nearest few
+  labels, the same distances classifyObject uses, so the classic result is
+  unchanged. The rows come from k nearest neighbour queries on the tree, k
+  doubling until they cover enough distinct labels: the first row of each
+  label in the nearest k is that label's nearest sample, and any label not
+  among them is farther than all of them. Falls back to a linear scan if
+  the tree is behind the model. The CNN is only asked for when the result
+  is Unknown or the next label is within minMargin of it, and then only
+  between the candidateCount nearest labels. A model with one label has an
+  infinite margin.
+*/
+CascadeDecision classifyCascade(const vector<double>& features,
+    const ClassicModel& model,
+    const FeatureTree& tree,
+    double distanceThreshold,
+    double minMargin,
+    int candidateCount) {
+    const int n = ClassicModel::featureCount;
+    CascadeDecision decision;
+    decision.margin = numeric_limits<double>::max();
+
+    const int rows = static_cast<int>(model.labels.size());
+    if (rows == 0 || features.size() < n) {
+        decision.classic = classifyObject(features, model, distanceThreshold);
+        decision.needsCNN = true;
+        return decision;
     }
 
-    double adjustedThreshold = distanceThreshold * 1.5;
+    const int labelCount = static_cast<int>(model.labelNames.size());
+    const int wanted = min(max(2, candidateCount), labelCount);
+    vector<double> labelSquared(labelCount, numeric_limits<double>::max());
+    // label ids, nearest first
+    vector<int> ranked;
 
-    result.label = bestLabel;
-    result.distance = minDistance;
-    result.isUnknown = (minDistance > adjustedThreshold);
+    if (static_cast<int>(tree.nodes.size()) == rows) {
+        vector<pair<double, int>> nearest;
+        int k = min(rows, max(8, 2 * wanted));
+        while (true) {
+            searchFeatureTree(tree, model, features.data(), k, nearest);
+            ranked.clear();
+            fill(labelSquared.begin(), labelSquared.end(), numeric_limits<double>::max());
+            for (const auto& neighbour : nearest) {
+                int id = model.labelIds[neighbour.second];
+                if (labelSquared[id] == numeric_limits<double>::max()) {
+                    labelSquared[id] = neighbour.first;
+                    ranked.push_back(id);
+                }
+            }
+            if (static_cast<int>(ranked.size()) >= wanted || k == rows) {
+                break;
+            }
+            k = min(rows, 2 * k);
+        }
+    }
+    else {
+        double query[n];
+        for (int i = 0; i < n; i++) {
+            query[i] = features[i] * model.scale[i];
+        }
+        const double* row = model.scaledFeatures.data();
+        for (int s = 0; s < rows; s++, row += n) {
+            double squared = 0.0;
+            for (int i = 0; i < n; i++) {
+                double d = query[i] - row[i];
+                squared += d * d;
+            }
+            int id = model.labelIds[s];
+            if (labelSquared[id] == numeric_limits<double>::max()) {
+                ranked.push_back(id);
+            }
+            labelSquared[id] = min(labelSquared[id], squared);
+        }
+        sort(ranked.begin(), ranked.end(), [&](int a, int b) { return labelSquared[a] < labelSquared[b]; });
+    }
 
-    return result;
+    double bestDistance = sqrt(labelSquared[ranked[0]]);
+    decision.classic.label = model.labelNames[ranked[0]];
+    decision.classic.distance = bestDistance;
+    decision.classic.isUnknown = (bestDistance > distanceThreshold * 1.5);
+    if (ranked.size() > 1) {
+        decision.margin = sqrt(labelSquared[ranked[1]]) - bestDistance;
+    }
+
+    decision.needsCNN = decision.classic.isUnknown || decision.margin < minMargin;
+    if (decision.needsCNN) {
+        int kept = min(max(1, candidateCount), static_cast<int>(ranked.size()));
+        for (int c = 0; c < kept; c++) {
+            decision.candidates.push_back(model.labelNames[ranked[c]]);
+        }
+    }
+    return decision;
 }
 
 /*
@@ -87,7 +276,9 @@ ClassificationResult classifyObject(const vector<double>& features,
   distanceThreshold : maximum allowed distance 
 
   Classifies objects using L2 distance on CNN embeddings for one-shot
-  recognition with deep feature representations.
+  recognition with deep feature representations. Samples are ranked by
+  squared distance through the SIMD kernels and only the winner gets a
+  square root. Samples whose embedding has a different length are skipped.
 */
 ClassificationResult classifyObjectCNN(const std::vector<float>& cnnEmbedding,
     const std::vector<TrainingSample>& trainingData,
@@ -101,24 +292,20 @@ ClassificationResult classifyObjectCNN(const std::vector<float>& cnnEmbedding,
         return result;
     }
 
-    float minDistance = std::numeric_limits<float>::max();
+    float minSquared = std::numeric_limits<float>::max();
     std::string bestLabel = "Unknown";
+    const int length = static_cast<int>(cnnEmbedding.size());
 
     for (const auto& sample : trainingData) {
-        if (sample.cnnEmbedding.empty()) continue;
-
-        float distance = 0.0f;
-        for (size_t i = 0; i < cnnEmbedding.size(); i++) {
-            float diff = cnnEmbedding[i] - sample.cnnEmbedding[i];
-            distance += diff * diff;
-        }
-        distance = std::sqrt(distance);
+        if (sample.cnnEmbedding.size() != cnnEmbedding.size()) continue;
 
-        if (distance < minDistance) {
-            minDistance = distance;
+        float squared = squaredL2Distance(cnnEmbedding.data(), sample.cnnEmbedding.data(), length);
+        if (squared < minSquared) {
+            minSquared = squared;
             bestLabel = sample.label;
         }
     }
+    float minDistance = (minSquared == std::numeric_limits<float>::max()) ? minSquared : std::sqrt(minSquared);
 
     result.label = bestLabel;
     result.distance = minDistance;
@@ -25,9 +25,64 @@ struct ClassificationResult {
     bool isUnknown;
 };
 
+/*
+  Classic feature classifier compiled from the training set. The per feature
+  mean and spread are kept as Welford running sums so adding a sample is
+  incremental, and every sample's features are also stored already
+  multiplied by scale (root of the feature weight over its standard
+  deviation) in one contiguous rows x featureCount array, so a query is a
+  single pass of plain squared differences. The rows are normally the
+  samples themselves, one row per training sample, but can be a smaller
+  reference set scaled by the same statistics. labels holds each row's
+  label, and labelIds the same as an index into labelNames, the distinct
+  labels, for code that groups rows by label.
+*/
+struct ClassicModel {
+    static const int featureCount = 4;
+    int count = 0;
+    double mean[featureCount] = {};
+    double sumSquares[featureCount] = {};
+    double scale[featureCount] = {};
+    std::vector<double> rawFeatures;
+    std::vector<double> scaledFeatures;
+    std::vector<std::string> labels;
+    std::vector<int> labelIds;
+    std::vector<std::string> labelNames;
+};
+
+struct FeatureTree;
+
+void buildClassicModel(ClassicModel& model, const std::vector<TrainingSample>& trainingData);
+void addToClassicModel(ClassicModel& model, const TrainingSample& sample);
+
 ClassificationResult classifyObject(const std::vector<double>& features,
     const std::vector<TrainingSample>& trainingData,
     double distanceThreshold = 2.0);
+ClassificationResult classifyObject(const std::vector<double>& features,
+    const ClassicModel& model,
+    double distanceThreshold = 2.0);
+
+/*
+  Classic stage of the cascade classifier. classic is the usual classic
+  result and margin how much farther away the nearest sample of any other
+  label is than the best match. needsCNN is set when the classic answer
+  can't be trusted on its own, because it is Unknown or the margin is too
+  small, and candidates then lists the nearest labels, best first, which
+  are all the CNN has to choose between.
+*/
+struct CascadeDecision {
+    ClassificationResult classic;
+    double margin;
+    bool needsCNN;
+    std::vector<std::string> candidates;
+};
+
+CascadeDecision classifyCascade(const std::vector<double>& features,
+    const ClassicModel& model,
+    const FeatureTree& tree,
+    double distanceThreshold = 2.0,
+    double minMargin = 0.5,
+    int candidateCount = 3);
 
 ClassificationResult classifyObjectCNN(const std::vector<float>& cnnEmbedding,
     const std::vector<TrainingSample>& trainingData,
@@ -0,0 +1,446 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the embedding distance kernels. Each instruction set gets
+  its own squared L2 and inner product loop, compiled for that target even
+  when the rest of the program isn't, and the best one the CPU supports is
+  chosen once on first use.
+*/
+
+#include "distanceKernels.h"
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DISTANCE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// gcc and clang need each function marked with the instructions it may use,
+// msvc accepts the intrinsics anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+using namespace cv;
+using namespace std;
+
+typedef float (*DistanceKernel)(const float*, const float*, int);
+typedef float (*HalfDistanceKernel)(const float*, const uint16_t*, int);
+typedef float (*ScaledDistanceKernel)(const float*, const uint8_t*, const float*, int);
+
+/*
+  a, b : vectors of length floats
+
+  Portable versions, four independent sums so the compiler can keep several
+  additions in flight.
+*/
+static float squaredL2Scalar(const float* a, const float* b, int length) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= length; i += 4) {
+        float d0 = a[i] - b[i], d1 = a[i + 1] - b[i + 1];
+        float d2 = a[i + 2] - b[i + 2], d3 = a[i + 3] - b[i + 3];
+        s0 += d0 * d0; s1 += d1 * d1; s2 += d2 * d2; s3 += d3 * d3;
+    }
+    for (; i < length; i++) {
+        float d = a[i] - b[i];
+        s0 += d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+static float innerProductScalar(const float* a, const float* b, int length) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= length; i += 4) {
+        s0 += a[i] * b[i]; s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2]; s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < length; i++) {
+        s0 += a[i] * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+/*
+  value : IEEE half precision bits
+
+  Widens a half to a float, including subnormals, infinities and NaNs.
+*/
+static inline float halfToFloat(uint16_t value) {
+    uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0) {
+        float magnitude = ldexp(static_cast<float>(mantissa), -24);
+        memcpy(&bits, &magnitude, sizeof(bits));
+        bits |= sign;
+    }
+    else if (exponent == 31) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/*
+  query : float vector
+  values : half precision vector
+  length : number of elements
+
+  Portable asymmetric distance to a half precision gallery row.
+*/
+static float squaredL2HalfScalar(const float* query, const uint16_t* values, int length) {
+    float s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= length; i += 2) {
+        float d0 = query[i] - halfToFloat(values[i]);
+        float d1 = query[i + 1] - halfToFloat(values[i + 1]);
+        s0 += d0 * d0; s1 += d1 * d1;
+    }
+    for (; i < length; i++) {
+        float d = query[i] - halfToFloat(values[i]);
+        s0 += d * d;
+    }
+    return s0 + s1;
+}
+
+/*
+  query : float vector with the per dimension offsets already subtracted
+  codes : 8 bit codes of a gallery row
+  scales : per dimension step between codes
+  length : number of elements
+
+  Portable asymmetric distance to an 8 bit scaled gallery row, whose value in
+  each dimension is offset + scale * code.
+*/
+static float squaredL2ScaledScalar(const float* query, const uint8_t* codes, const float* scales, int length) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= length; i += 4) {
+        float d0 = query[i] - scales[i] * codes[i];
+        float d1 = query[i + 1] - scales[i + 1] * codes[i + 1];
+        float d2 = query[i + 2] - scales[i + 2] * codes[i + 2];
+        float d3 = query[i + 3] - scales[i + 3] * codes[i + 3];
+        s0 += d0 * d0; s1 += d1 * d1; s2 += d2 * d2; s3 += d3 * d3;
+    }
+    for (; i < length; i++) {
+        float d = query[i] - scales[i] * codes[i];
+        s0 += d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+/*
+  sum : four partial sums
+
+  Adds the lanes of an SSE register.
+*/
+static inline float horizontalSum(__m128 sum) {
+    __m128 shuffled = _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1));
+    sum = _mm_add_ps(sum, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sum);
+    return _mm_cvtss_f32(_mm_add_ss(sum, shuffled));
+}
+
+/*
+  a, b : vectors of length floats
+
+  SSE2 versions, two 4 wide accumulators.
+*/
+static float squaredL2Sse2(const float* a, const float* b, int length) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    float sum = horizontalSum(_mm_add_ps(acc0, acc1));
+    for (; i < length; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static float innerProductSse2(const float* a, const float* b, int length) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float sum = horizontalSum(_mm_add_ps(acc0, acc1));
+    for (; i < length; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/*
+  a, b : vectors of length floats
+
+  AVX2 versions, two 8 wide fused multiply-add accumulators.
+*/
+KERNEL_TARGET("avx2,fma")
+static float squaredL2Avx2(const float* a, const float* b, int length) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    float sum = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i < length; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+KERNEL_TARGET("avx2,fma")
+static float innerProductAvx2(const float* a, const float* b, int length) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    float sum = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i < length; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/*
+  query, values / codes, scales, length : as for the scalar versions
+
+  AVX2 versions of the quantized distances, widening 8 elements at a time
+  with F16C or a zero extend.
+*/
+KERNEL_TARGET("avx2,fma,f16c")
+static float squaredL2HalfAvx2(const float* query, const uint16_t* values, int length) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256 widened = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)));
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(query + i), widened);
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    float sum = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i < length; i++) {
+        float d = query[i] - halfToFloat(values[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+KERNEL_TARGET("avx2,fma")
+static float squaredL2ScaledAvx2(const float* query, const uint8_t* codes, const float* scales, int length) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes + i));
+        __m256 widened = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(packed));
+        __m256 d = _mm256_fnmadd_ps(_mm256_loadu_ps(scales + i), widened, _mm256_loadu_ps(query + i));
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    float sum = horizontalSum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i < length; i++) {
+        float d = query[i] - scales[i] * codes[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+/*
+  a, b : vectors of length floats
+
+  AVX-512 versions, 16 wide with the tail done as one masked load so there
+  is no scalar remainder loop.
+*/
+KERNEL_TARGET("avx512f")
+static float squaredL2Avx512(const float* a, const float* b, int length) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i < length; i += 16) {
+        int remaining = length - i;
+        __mmask16 mask = (remaining >= 16) ? 0xFFFF : static_cast<__mmask16>((1u << remaining) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+KERNEL_TARGET("avx512f")
+static float innerProductAvx512(const float* a, const float* b, int length) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= length; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i < length; i += 16) {
+        int remaining = length - i;
+        __mmask16 mask = (remaining >= 16) ? 0xFFFF : static_cast<__mmask16>((1u << remaining) - 1);
+        acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+#endif
+
+/*
+  The kernels in use, picked the first time any distance is asked for.
+  OpenCV's hardware check covers both the CPU flags and whether the OS saves
+  the wider registers. The quantized distances only have AVX2 versions,
+  which the AVX-512 level uses as well.
+*/
+struct DistanceKernelTable {
+    DistanceKernelLevel level = KERNEL_SCALAR;
+    DistanceKernel squaredL2 = squaredL2Scalar;
+    DistanceKernel innerProduct = innerProductScalar;
+    HalfDistanceKernel squaredL2Half = squaredL2HalfScalar;
+    ScaledDistanceKernel squaredL2Scaled = squaredL2ScaledScalar;
+};
+
+static const DistanceKernelTable& distanceKernels() {
+    static const DistanceKernelTable table = [] {
+        DistanceKernelTable kernels;
+#ifdef DISTANCE_KERNELS_X86
+        if (checkHardwareSupport(CV_CPU_AVX_512F)) {
+            kernels.level = KERNEL_AVX512;
+            kernels.squaredL2 = squaredL2Avx512;
+            kernels.innerProduct = innerProductAvx512;
+        }
+        else if (checkHardwareSupport(CV_CPU_AVX2) && checkHardwareSupport(CV_CPU_FMA3)) {
+            kernels.level = KERNEL_AVX2;
+            kernels.squaredL2 = squaredL2Avx2;
+            kernels.innerProduct = innerProductAvx2;
+        }
+        else if (checkHardwareSupport(CV_CPU_SSE2)) {
+            kernels.level = KERNEL_SSE2;
+            kernels.squaredL2 = squaredL2Sse2;
+            kernels.innerProduct = innerProductSse2;
+        }
+        if (kernels.level >= KERNEL_AVX2 && checkHardwareSupport(CV_CPU_AVX2) && checkHardwareSupport(CV_CPU_FMA3)) {
+            kernels.squaredL2Scaled = squaredL2ScaledAvx2;
+            if (checkHardwareSupport(CV_CPU_FP16)) {
+                kernels.squaredL2Half = squaredL2HalfAvx2;
+            }
+        }
+#endif
+        return kernels;
+    }();
+    return table;
+}
+
+/*
+  Which instruction set the distance kernels run on, and its name for logging.
+*/
+DistanceKernelLevel distanceKernelLevel() {
+    return distanceKernels().level;
+}
+
+const char* distanceKernelName() {
+    static const char* names[] = { "scalar", "SSE2", "AVX2", "AVX-512" };
+    return names[distanceKernelLevel()];
+}
+
+/*
+  a : first vector
+  b : second vector
+  length : number of floats in each
+
+  Squared euclidean distance, the cheapest to rank nearest neighbours by.
+*/
+float squaredL2Distance(const float* a, const float* b, int length) {
+    return distanceKernels().squaredL2(a, b, length);
+}
+
+/*
+  a : first vector
+  b : second vector
+  length : number of floats in each
+
+  Euclidean distance.
+*/
+float l2Distance(const float* a, const float* b, int length) {
+    return sqrt(distanceKernels().squaredL2(a, b, length));
+}
+
+/*
+  a : first vector
+  b : second vector
+  length : number of floats in each
+
+  Dot product of the two vectors.
+*/
+float innerProduct(const float* a, const float* b, int length) {
+    return distanceKernels().innerProduct(a, b, length);
+}
+
+/*
+  a : first vector
+  b : second vector
+  length : number of floats in each
+
+  One minus the cosine of the angle between the vectors, 0 for the same
+  direction and 2 for opposite ones. A zero vector is treated as being at
+  distance 1 from everything.
+*/
+float cosineDistance(const float* a, const float* b, int length) {
+    const DistanceKernelTable& kernels = distanceKernels();
+    float normProduct = sqrt(kernels.innerProduct(a, a, length) * kernels.innerProduct(b, b, length));
+    if (normProduct <= 0) {
+        return 1.0f;
+    }
+    return 1.0f - kernels.innerProduct(a, b, length) / normProduct;
+}
+
+/*
+  query : float vector
+  values : half precision gallery row
+  length : number of elements
+
+  Squared euclidean distance from a float query to a half precision row.
+*/
+float squaredL2DistanceHalf(const float* query, const uint16_t* values, int length) {
+    return distanceKernels().squaredL2Half(query, values, length);
+}
+
+/*
+  query : float vector with the row's per dimension offsets already subtracted
+  codes : 8 bit codes of the gallery row
+  scales : per dimension step between codes
+  length : number of elements
+
+  Squared euclidean distance from a float query to an 8 bit scaled row.
+*/
+float squaredL2DistanceScaled(const float* query, const uint8_t* codes, const float* scales, int length) {
+    return distanceKernels().squaredL2Scaled(query, codes, scales, length);
+}
@@ -0,0 +1,35 @@
+/*
+  Nihal Sandadi
+
+  Header file for the embedding distance kernels: squared L2, L2, inner
+  product and cosine distance, with SSE2, AVX2 and AVX-512 versions picked at
+  runtime for the CPU the program is running on.
+*/
+
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include <cstdint>
+
+/*
+  Instruction set the kernels were dispatched to, scalar when the CPU has
+  none of the others or isn't x86.
+*/
+enum DistanceKernelLevel {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512
+};
+
+DistanceKernelLevel distanceKernelLevel();
+const char* distanceKernelName();
+
+float squaredL2Distance(const float* a, const float* b, int length);
+float l2Distance(const float* a, const float* b, int length);
+float innerProduct(const float* a, const float* b, int length);
+float cosineDistance(const float* a, const float* b, int length);
+float squaredL2DistanceHalf(const float* query, const uint16_t* values, int length);
+float squaredL2DistanceScaled(const float* query, const uint8_t* codes, const float* scales, int length);
+
+#endif
@@ -0,0 +1,646 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the batched CNN embedding search. All of a frame's
+  queries are compared against the gallery with one matrix product per
+  gallery block, so the gallery is read once per frame instead of once per
+  object.
+*/
+
+#include "embeddingGallery.h"
+#include "distanceKernels.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <queue>
+#include <cstring>
+#include <cstdint>
+
+using namespace cv;
+using namespace std;
+
+// gallery rows per block, a block of 512 float embeddings is about 2 MB
+static const int galleryBlockRows = 1024;
+// principal components in the pruned search's lower bound
+static const int prefixComponents = 32;
+// floats summed between checks of the running distance against the bound
+static const int abandonChunk = 64;
+
+/*
+  gallery : gallery whose rows the index covers
+
+  The gallery rows as the HNSW index sees them.
+*/
+static HnswVectors galleryVectors(const EmbeddingGallery& gallery) {
+    return { gallery.embeddings.ptr<float>(), gallery.embeddings.step1() };
+}
+
+/*
+  gallery : gallery to measure
+
+  Length of the gallery's embeddings, from the quantized rows once the full
+  precision ones are released.
+*/
+static int galleryLength(const EmbeddingGallery& gallery) {
+    return galleryRowsReleased(gallery) ? gallery.quantized.dim : gallery.embeddings.cols;
+}
+
+/*
+  gallery : gallery in a quantized mode
+
+  Drops the full precision rows once the quantized rows cover all of them
+  and their format is settled, leaving the compressed rows as the only copy.
+  Until then the full precision rows are kept for refitting.
+*/
+static void releaseSettledRows(EmbeddingGallery& gallery) {
+    if (quantizedGallerySettled(gallery.quantized) && gallery.quantized.count == static_cast<int>(gallery.labels.size())) {
+        gallery.embeddings.release();
+    }
+}
+
+/*
+  gallery : gallery to extend
+  sample : new training sample
+
+  Appends the sample's embedding as a new row, and inserts it into the index
+  if the gallery is in HNSW mode, without updating the other modes' quantized
+  rows or prefix projections. Once the full precision rows are released the
+  embedding is encoded straight into the quantized rows instead. Returns
+  false for a sample without an embedding, or with a different length than
+  the gallery's, which is skipped.
+*/
+static bool appendGalleryRow(EmbeddingGallery& gallery, const TrainingSample& sample) {
+    if (sample.cnnEmbedding.empty()) {
+        return false;
+    }
+    if (!gallery.labels.empty() && galleryLength(gallery) != static_cast<int>(sample.cnnEmbedding.size())) {
+        return false;
+    }
+
+    const float* data = sample.cnnEmbedding.data();
+    const int length = static_cast<int>(sample.cnnEmbedding.size());
+    if (galleryRowsReleased(gallery)) {
+        appendQuantizedRow(gallery.quantized, data);
+    }
+    else {
+        gallery.embeddings.push_back(Mat(1, length, CV_32F, const_cast<float*>(data)));
+    }
+    gallery.squaredNorms.push_back(innerProduct(data, data, length));
+    gallery.labels.push_back(sample.label);
+    auto name = find(gallery.labelNames.begin(), gallery.labelNames.end(), sample.label);
+    if (name == gallery.labelNames.end()) {
+        gallery.labelNames.push_back(sample.label);
+        gallery.labelRows.emplace_back();
+        name = gallery.labelNames.end() - 1;
+    }
+    gallery.labelRows[name - gallery.labelNames.begin()].push_back(static_cast<int>(gallery.labels.size()) - 1);
+    if (gallery.searchMode == GALLERY_HNSW) {
+        gallery.index.add(galleryVectors(gallery), length);
+    }
+    return true;
+}
+
+/*
+  gallery : gallery to fill
+  trainingData : collection of training samples
+
+  Packs every sample's CNN embedding into the gallery, replacing what it
+  held. The search mode is kept, and its index, quantized rows or prefix
+  projections are rebuilt for the new rows. Set searchMode before building
+  to avoid building an index the gallery won't use.
+*/
+void buildEmbeddingGallery(EmbeddingGallery& gallery, const vector<TrainingSample>& trainingData) {
+    gallery.embeddings.release();
+    gallery.squaredNorms.clear();
+    gallery.labels.clear();
+    gallery.labelNames.clear();
+    gallery.labelRows.clear();
+    gallery.index.clear();
+    gallery.quantized = QuantizedGallery();
+    gallery.prefixBasis = PCA();
+    gallery.prefixProjections.release();
+    gallery.prefixFittedRows = 0;
+    gallery.sortedNorms.clear();
+    for (const auto& sample : trainingData) {
+        appendGalleryRow(gallery, sample);
+    }
+    setGallerySearchMode(gallery, gallery.searchMode);
+}
+
+/*
+  mode : search mode
+
+  The quantized format a search mode scans, if it is one of the quantized
+  modes.
+*/
+static bool quantizedStorageFor(GallerySearchMode mode, QuantizedStorage& storage) {
+    switch (mode) {
+    case GALLERY_FP16: storage = QUANTIZED_FP16; return true;
+    case GALLERY_INT8: storage = QUANTIZED_INT8; return true;
+    case GALLERY_PQ: storage = QUANTIZED_PQ; return true;
+    default: return false;
+    }
+}
+
+/*
+  gallery : gallery whose prefix projections to update
+
+  Projects rows added since the last call onto the principal component
+  prefix and files their norms into sortedNorms. The basis is refitted from
+  all rows whenever they have doubled since it was last fitted; in between,
+  new rows are projected onto the old basis, which is still orthonormal, so
+  the bound stays valid, just looser.
+*/
+static void syncPrefixProjections(EmbeddingGallery& gallery) {
+    int rows = gallery.embeddings.rows;
+    if (rows < 2) {
+        gallery.prefixBasis = PCA();
+        gallery.prefixProjections.release();
+        gallery.prefixFittedRows = 0;
+        gallery.sortedNorms.clear();
+        return;
+    }
+
+    if (gallery.prefixFittedRows == 0 || rows >= 2 * gallery.prefixFittedRows) {
+        gallery.prefixBasis = PCA(gallery.embeddings, noArray(), PCA::DATA_AS_ROW, min(prefixComponents, rows));
+        gallery.prefixProjections = gallery.prefixBasis.project(gallery.embeddings);
+        gallery.prefixFittedRows = rows;
+        gallery.sortedNorms.resize(rows);
+        for (int row = 0; row < rows; row++) {
+            gallery.sortedNorms[row] = { sqrt(gallery.squaredNorms[row]), row };
+        }
+        sort(gallery.sortedNorms.begin(), gallery.sortedNorms.end());
+        return;
+    }
+
+    for (int row = gallery.prefixProjections.rows; row < rows; row++) {
+        gallery.prefixProjections.push_back(gallery.prefixBasis.project(gallery.embeddings.row(row)));
+        pair<float, int> norm(sqrt(gallery.squaredNorms[row]), row);
+        gallery.sortedNorms.insert(upper_bound(gallery.sortedNorms.begin(), gallery.sortedNorms.end(), norm), norm);
+    }
+}
+
+/*
+  gallery : gallery to switch
+  mode : how to search it from now on
+  report : output, if given, how the quantized rows compare with the full precision ones
+
+  Selects the search mode, encoding the rows in the quantized format when
+  switching to one. Once that format is settled the full precision rows are
+  released, so a quantized gallery holds only the compressed rows; the
+  report is measured just before. Every other mode needs the full precision
+  rows, so a gallery that has released them is left as it is here and has
+  to be rebuilt from the training data first. Leaving the quantized formats
+  frees the quantized rows, no other mode reads them. The HNSW index is
+  only extended while in HNSW mode; switching back to it inserts the rows
+  added in the meantime.
+*/
+void setGallerySearchMode(EmbeddingGallery& gallery, GallerySearchMode mode, QuantizationReport* report) {
+    QuantizedStorage storage;
+    bool quantizedMode = quantizedStorageFor(mode, storage);
+    if (galleryRowsReleased(gallery) && !(quantizedMode && gallery.quantized.storage == storage)) {
+        return;
+    }
+    gallery.searchMode = mode;
+    if (!quantizedMode) {
+        gallery.quantized = QuantizedGallery();
+    }
+    if (mode == GALLERY_HNSW) {
+        while (gallery.index.size() < gallery.embeddings.rows) {
+            gallery.index.add(galleryVectors(gallery), gallery.embeddings.cols);
+        }
+        return;
+    }
+    if (mode == GALLERY_PRUNED) {
+        syncPrefixProjections(gallery);
+        return;
+    }
+    if (!quantizedMode) {
+        return;
+    }
+    if (galleryRowsReleased(gallery)) {
+        return;
+    }
+    if (gallery.quantized.storage != storage || gallery.quantized.count == 0) {
+        buildQuantizedGallery(gallery.quantized, storage, gallery.embeddings);
+    }
+    else {
+        syncQuantizedGallery(gallery.quantized, gallery.embeddings);
+    }
+    if (report) {
+        *report = measureQuantization(gallery.quantized, gallery.embeddings);
+    }
+    releaseSettledRows(gallery);
+}
+
+/*
+  gallery : gallery to check
+
+  Whether a quantized mode has released the full precision rows, leaving
+  the quantized rows as the gallery's only copy.
+*/
+bool galleryRowsReleased(const EmbeddingGallery& gallery) {
+    return gallery.embeddings.empty() && !gallery.labels.empty();
+}
+
+/*
+  gallery : gallery to read
+  embeddings : output, one CV_32F row per gallery row
+
+  The gallery's rows in full precision: the rows themselves, shared rather
+  than copied, or the quantized rows widened back if they were released.
+*/
+void galleryEmbeddings(const EmbeddingGallery& gallery, Mat& embeddings) {
+    if (galleryRowsReleased(gallery)) {
+        decodeQuantizedGallery(gallery.quantized, embeddings);
+    }
+    else {
+        embeddings = gallery.embeddings;
+    }
+}
+
+/*
+  mode : search mode
+
+  Short name of the mode for messages.
+*/
+const char* gallerySearchModeName(GallerySearchMode mode) {
+    static const char* names[] = { "EXACT", "HNSW", "PRUNED", "FP16", "INT8", "PQ" };
+    return names[mode];
+}
+
+/*
+  gallery : gallery to extend
+  sample : new training sample
+
+  Appends the sample's embedding as a new row, keeping the selected mode's
+  index, quantized rows or prefix projections up to date. A quantized
+  gallery still holding its full precision rows releases them once the
+  format settles. Samples without an embedding, or with a different length
+  than the gallery's, are skipped.
+*/
+void addToEmbeddingGallery(EmbeddingGallery& gallery, const TrainingSample& sample) {
+    if (!appendGalleryRow(gallery, sample)) {
+        return;
+    }
+
+    QuantizedStorage storage;
+    if (quantizedStorageFor(gallery.searchMode, storage) && !gallery.embeddings.empty()) {
+        syncQuantizedGallery(gallery.quantized, gallery.embeddings);
+        releaseSettledRows(gallery);
+    }
+    else if (gallery.searchMode == GALLERY_PRUNED) {
+        syncPrefixProjections(gallery);
+    }
+}
+
+/*
+  gallery : gallery whose rows to identify
+
+  64 bit FNV-1a hash of the row count, the row length and every row's bytes,
+  taken a word at a time. Two galleries only share it if they hold the same
+  embeddings in the same order.
+*/
+static uint64_t rowFingerprint(const EmbeddingGallery& gallery) {
+    const uint64_t prime = 1099511628211ULL;
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ static_cast<uint64_t>(gallery.embeddings.rows)) * prime;
+    hash = (hash ^ static_cast<uint64_t>(gallery.embeddings.cols)) * prime;
+    for (int row = 0; row < gallery.embeddings.rows; row++) {
+        const uchar* bytes = gallery.embeddings.ptr<uchar>(row);
+        size_t length = gallery.embeddings.cols * sizeof(float);
+        size_t b = 0;
+        for (; b + sizeof(uint64_t) <= length; b += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, bytes + b, sizeof(word));
+            hash = (hash ^ word) * prime;
+        }
+        for (; b < length; b++) {
+            hash = (hash ^ bytes[b]) * prime;
+        }
+    }
+    return hash;
+}
+
+/*
+  gallery : gallery whose index to write
+  filename : path of the index file, normally next to the training data
+
+  Saves the gallery's HNSW index, tagged with the fingerprint of the rows it
+  was built over, so the next start can load it instead of rebuilding it.
+  Returns false without writing if the index doesn't cover every row, as
+  when the gallery has been trained outside HNSW mode, or if a quantized
+  mode has released the rows the fingerprint is taken over.
+*/
+bool saveGalleryIndex(const EmbeddingGallery& gallery, const string& filename) {
+    if (galleryRowsReleased(gallery) || gallery.index.size() != gallery.embeddings.rows) {
+        return false;
+    }
+    return gallery.index.save(filename, rowFingerprint(gallery));
+}
+
+/*
+  gallery : gallery already filled with the training embeddings
+  filename : path of an index saved by saveGalleryIndex
+
+  Replaces the gallery's index with the saved one and selects HNSW search.
+  The file is only used if its fingerprint matches the gallery's rows, so an
+  index built over any other set of embeddings, even one of the same size,
+  is rejected. The index is then rebuilt from the rows instead. Returns
+  whether the saved index was used.
+*/
+bool loadGalleryIndex(EmbeddingGallery& gallery, const string& filename) {
+    uint64_t fingerprint = 0;
+    bool loaded = gallery.index.load(filename, &fingerprint) && gallery.index.size() == gallery.embeddings.rows &&
+        fingerprint == rowFingerprint(gallery);
+    if (!loaded) {
+        gallery.index.clear();
+    }
+    setGallerySearchMode(gallery, GALLERY_HNSW);
+    return loaded;
+}
+
+/*
+  matches : best matches so far, at most k
+  candidate : new match
+  k : number of matches to keep
+
+  Keeps the k closest matches sorted nearest first.
+*/
+static void keepBest(vector<GalleryMatch>& matches, const GalleryMatch& candidate, int k) {
+    if (static_cast<int>(matches.size()) == k && candidate.distance >= matches.back().distance) {
+        return;
+    }
+    auto position = upper_bound(matches.begin(), matches.end(), candidate,
+        [](const GalleryMatch& a, const GalleryMatch& b) { return a.distance < b.distance; });
+    matches.insert(position, candidate);
+    if (static_cast<int>(matches.size()) > k) {
+        matches.pop_back();
+    }
+}
+
+/*
+  gallery : gallery with up to date prefix projections
+  query : query embedding
+  k : number of nearest rows wanted
+  maxDistance : rows farther than this are of no interest
+  matches : output, up to k nearest rows within maxDistance, nearest first
+
+  Exact search that avoids most of the full length distances. Rows are
+  visited in order of the norm bound (|q| - |g|)^2, walking outwards in
+  both directions from |q|'s place in the sorted norms and taking the
+  closer side each step, which ends the search outright once both sides
+  reach the current kth best. Each remaining row is then checked against
+  the bound from the principal component prefix, and only rows passing both
+  get a full distance, summed in chunks and abandoned as soon as the
+  partial sum passes the kth best or maxDistance. A query that closely
+  matches one row prunes almost everything else after finding it.
+*/
+static void prunedSearch(const EmbeddingGallery& gallery, const float* query, int k, float maxDistance,
+    vector<GalleryMatch>& matches) {
+
+    const int rows = gallery.embeddings.rows;
+    const int length = gallery.embeddings.cols;
+    float bound = (maxDistance < sqrt(numeric_limits<float>::max())) ? maxDistance * maxDistance :
+        numeric_limits<float>::max();
+
+    const vector<pair<float, int>>& norms = gallery.sortedNorms;
+    float queryNorm = sqrt(innerProduct(query, query, length));
+    int above = static_cast<int>(lower_bound(norms.begin(), norms.end(), pair<float, int>(queryNorm, -1)) -
+        norms.begin());
+    int below = above - 1;
+
+    Mat queryPrefix = gallery.prefixBasis.project(Mat(1, length, CV_32F, const_cast<float*>(query)));
+    const int prefixLength = queryPrefix.cols;
+
+    priority_queue<pair<float, int>> nearest;
+    while (below >= 0 || above < rows) {
+        float worst = (static_cast<int>(nearest.size()) < k) ? bound : min(bound, nearest.top().first);
+        float gapBelow = (below >= 0) ? queryNorm - norms[below].first : numeric_limits<float>::max();
+        float gapAbove = (above < rows) ? norms[above].first - queryNorm : numeric_limits<float>::max();
+        float normGap = min(gapBelow, gapAbove);
+        if (normGap * normGap >= worst) {
+            break;
+        }
+
+        int g = (gapBelow <= gapAbove) ? norms[below--].second : norms[above++].second;
+        if (squaredL2Distance(queryPrefix.ptr<float>(), gallery.prefixProjections.ptr<float>(g), prefixLength) >= worst) {
+            continue;
+        }
+
+        const float* row = gallery.embeddings.ptr<float>(g);
+        float squared = 0;
+        for (int start = 0; start < length && squared < worst; start += abandonChunk) {
+            squared += squaredL2Distance(query + start, row + start, min(abandonChunk, length - start));
+        }
+        if (squared < worst) {
+            nearest.push({ squared, g });
+            if (static_cast<int>(nearest.size()) > k) {
+                nearest.pop();
+            }
+        }
+    }
+
+    matches.resize(nearest.size());
+    for (int i = static_cast<int>(nearest.size()) - 1; i >= 0; i--) {
+        matches[i] = { nearest.top().second, sqrt(nearest.top().first) };
+        nearest.pop();
+    }
+}
+
+/*
+  gallery : packed training embeddings
+  queries : one CV_32F query embedding per row, as long as the gallery rows
+  k : number of nearest gallery rows to return per query
+  matches : output, the k nearest rows for each query, nearest first
+  maxDistance : rows farther than this may be left out, only the pruned search uses it
+
+  Finds each query's k nearest gallery rows. The squared distances come from
+  ||q||^2 + ||g||^2 - 2 q.g, with the products for a whole block of gallery
+  rows and all queries done by one gemm. Blocks run in parallel and keep
+  their own top k, which are merged at the end. The reported distances of
+  the winners are then recomputed directly, since the expanded form loses
+  precision when the two norms are close.
+
+  In GALLERY_HNSW mode each query instead walks the index, queries in
+  parallel, and the distances come out exact. GALLERY_PRUNED runs the
+  pruned exact search per query. The quantized modes scan the compressed
+  rows per query and report the approximate distances; they are the only
+  modes that work once the full precision rows are released.
+*/
+void searchEmbeddingGallery(const EmbeddingGallery& gallery, const Mat& queries, int k,
+    vector<vector<GalleryMatch>>& matches, float maxDistance) {
+
+    matches.assign(queries.rows, vector<GalleryMatch>());
+    if (gallery.labels.empty() || queries.empty() || k <= 0 ||
+        queries.type() != CV_32F || queries.cols != galleryLength(gallery)) {
+        return;
+    }
+
+    const int length = queries.cols;
+    if (gallery.searchMode == GALLERY_HNSW && gallery.index.size() == gallery.embeddings.rows) {
+        parallel_for_(Range(0, queries.rows), [&](const Range& range) {
+            vector<pair<float, int>> nearest;
+            for (int q = range.start; q < range.end; q++) {
+                gallery.index.search(galleryVectors(gallery), queries.ptr<float>(q), k, nearest);
+                for (const auto& neighbor : nearest) {
+                    matches[q].push_back({ neighbor.second, sqrt(neighbor.first) });
+                }
+            }
+        });
+        return;
+    }
+
+    if (gallery.searchMode == GALLERY_PRUNED && gallery.prefixProjections.rows == gallery.embeddings.rows) {
+        parallel_for_(Range(0, queries.rows), [&](const Range& range) {
+            for (int q = range.start; q < range.end; q++) {
+                prunedSearch(gallery, queries.ptr<float>(q), k, maxDistance, matches[q]);
+            }
+        });
+        return;
+    }
+
+    QuantizedStorage storage;
+    if (quantizedStorageFor(gallery.searchMode, storage) && gallery.quantized.storage == storage &&
+        gallery.quantized.count == static_cast<int>(gallery.labels.size())) {
+        parallel_for_(Range(0, queries.rows), [&](const Range& range) {
+            vector<pair<float, int>> nearest;
+            for (int q = range.start; q < range.end; q++) {
+                searchQuantizedGallery(gallery.quantized, queries.ptr<float>(q), k, nearest);
+                for (const auto& neighbor : nearest) {
+                    matches[q].push_back({ neighbor.second, sqrt(neighbor.first) });
+                }
+            }
+        });
+        return;
+    }
+    if (galleryRowsReleased(gallery)) {
+        return;
+    }
+
+    vector<float> queryNorms(queries.rows);
+    for (int q = 0; q < queries.rows; q++) {
+        queryNorms[q] = innerProduct(queries.ptr<float>(q), queries.ptr<float>(q), length);
+    }
+
+    const int blocks = (gallery.embeddings.rows + galleryBlockRows - 1) / galleryBlockRows;
+    vector<vector<vector<GalleryMatch>>> blockMatches(blocks, vector<vector<GalleryMatch>>(queries.rows));
+
+    parallel_for_(Range(0, blocks), [&](const Range& range) {
+        Mat products;
+        for (int block = range.start; block < range.end; block++) {
+            int first = block * galleryBlockRows;
+            int last = min(first + galleryBlockRows, gallery.embeddings.rows);
+            gemm(queries, gallery.embeddings.rowRange(first, last), 1.0, noArray(), 0.0, products, GEMM_2_T);
+
+            for (int q = 0; q < queries.rows; q++) {
+                const float* product = products.ptr<float>(q);
+                for (int g = first; g < last; g++) {
+                    float squared = queryNorms[q] + gallery.squaredNorms[g] - 2.0f * product[g - first];
+                    keepBest(blockMatches[block][q], { g, max(squared, 0.0f) }, k);
+                }
+            }
+        }
+    });
+
+    for (int q = 0; q < queries.rows; q++) {
+        for (int block = 0; block < blocks; block++) {
+            for (const auto& match : blockMatches[block][q]) {
+                keepBest(matches[q], match, k);
+            }
+        }
+        for (auto& match : matches[q]) {
+            match.distance = l2Distance(queries.ptr<float>(q), gallery.embeddings.ptr<float>(match.index), length);
+        }
+        sort(matches[q].begin(), matches[q].end(),
+            [](const GalleryMatch& a, const GalleryMatch& b) { return a.distance < b.distance; });
+    }
+}
+
+/*
+  queries : one CV_32F embedding per row, one row per object in the frame
+  gallery : packed training embeddings
+  distanceThreshold : maximum allowed distance
+
+  Batched version of classifyObjectCNN, classifying every query by its
+  nearest gallery row in one search. The threshold is passed on to the
+  search, so in pruned mode a query with nothing within it comes back
+  unknown without its nearest row being worked out.
+*/
+vector<ClassificationResult> classifyObjectsCNN(const Mat& queries, const EmbeddingGallery& gallery,
+    float distanceThreshold) {
+
+    vector<vector<GalleryMatch>> matches;
+    searchEmbeddingGallery(gallery, queries, 1, matches, distanceThreshold);
+
+    vector<ClassificationResult> results(queries.rows);
+    for (int q = 0; q < queries.rows; q++) {
+        ClassificationResult& result = results[q];
+        if (matches[q].empty()) {
+            result.label = "Unknown";
+            result.distance = numeric_limits<float>::max();
+            result.isUnknown = true;
+            continue;
+        }
+        result.label = gallery.labels[matches[q][0].index];
+        result.distance = matches[q][0].distance;
+        result.isUnknown = (result.distance > distanceThreshold);
+    }
+    return results;
+}
+
+/*
+  embedding : CNN embedding of one object
+  gallery : packed training embeddings
+  candidates : labels the answer has to be one of, all labels if empty
+  distanceThreshold : maximum allowed distance
+
+  Second stage of the cascade classifier: the nearest gallery row among the
+  candidate labels only. The few candidate labels' rows, looked up in
+  labelRows, are scanned exactly whatever the gallery's search mode, an
+  index can't be restricted to them. Once the full precision rows are
+  released the scan uses the quantized rows' distances instead.
+*/
+ClassificationResult classifyObjectCNN(const vector<float>& embedding, const EmbeddingGallery& gallery,
+    const vector<string>& candidates, float distanceThreshold) {
+
+    ClassificationResult result;
+    result.label = "Unknown";
+    result.distance = numeric_limits<float>::max();
+    result.isUnknown = true;
+    if (gallery.labels.empty() || static_cast<int>(embedding.size()) != galleryLength(gallery)) {
+        return result;
+    }
+
+    vector<int> labelIds;
+    for (int id = 0; id < static_cast<int>(gallery.labelNames.size()); id++) {
+        if (candidates.empty() || find(candidates.begin(), candidates.end(), gallery.labelNames[id]) != candidates.end()) {
+            labelIds.push_back(id);
+        }
+    }
+
+    const bool released = galleryRowsReleased(gallery);
+    const int length = galleryLength(gallery);
+    float minSquared = numeric_limits<float>::max();
+    int best = -1;
+    for (int id : labelIds) {
+        for (int r : gallery.labelRows[id]) {
+            float squared = released ? quantizedDistance(gallery.quantized, embedding.data(), r) :
+                squaredL2Distance(embedding.data(), gallery.embeddings.ptr<float>(r), length);
+            if (squared < minSquared) {
+                minSquared = squared;
+                best = r;
+            }
+        }
+    }
+    if (best < 0) {
+        return result;
+    }
+
+    result.label = gallery.labels[best];
+    result.distance = sqrt(minSquared);
+    result.isUnknown = (result.distance > distanceThreshold);
+    return result;
+}
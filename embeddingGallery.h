@@ -0,0 +1,92 @@
+/*
+  Nihal Sandadi
+
+  Header file for the CNN embedding gallery, the training embeddings packed
+  into one matrix so every object in a frame can be matched in a single
+  batched search.
+*/
+
+#ifndef EMBEDDING_GALLERY_H
+#define EMBEDDING_GALLERY_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <limits>
+#include <utility>
+#include "trainingData.h"
+#include "classification.h"
+#include "hnswIndex.h"
+#include "quantizedGallery.h"
+
+/*
+  How the gallery is searched: an exact scan of every row, the HNSW index
+  for galleries too large to scan each frame, an exact search that skips
+  and abandons rows using lower bounds, or a scan of a half precision, 8 bit
+  or product quantized form of the rows. The exact scan stays available to
+  check the others' answers against.
+*/
+enum GallerySearchMode {
+    GALLERY_EXACT,
+    GALLERY_HNSW,
+    GALLERY_PRUNED,
+    GALLERY_FP16,
+    GALLERY_INT8,
+    GALLERY_PQ
+};
+
+/*
+  Training embeddings as the rows of one CV_32F matrix, with each row's
+  squared norm kept alongside so distances come from a single matrix
+  product. labels holds the label of each row, labelNames the distinct
+  labels and labelRows the rows of each of them, in labelNames order. index
+  is the HNSW graph over the rows, which it reads from embeddings rather
+  than keeping its own copy, only extended while HNSW mode is selected.
+  quantized holds the rows compressed, only while a quantized mode is
+  selected; once its format is settled embeddings is released and the
+  quantized rows are the only copy, labels then gives the row count.
+  prefixBasis holds the leading principal components of the rows and
+  prefixProjections each row projected onto them, the lower bound used by
+  the pruned search, and sortedNorms the row norms in ascending order with
+  their rows, all kept up to date while that mode is selected.
+  prefixFittedRows is how many rows the basis was fitted on.
+*/
+struct EmbeddingGallery {
+    cv::Mat embeddings;
+    std::vector<float> squaredNorms;
+    std::vector<std::string> labels;
+    std::vector<std::string> labelNames;
+    std::vector<std::vector<int>> labelRows;
+    HnswIndex index;
+    QuantizedGallery quantized;
+    cv::PCA prefixBasis;
+    cv::Mat prefixProjections;
+    std::vector<std::pair<float, int>> sortedNorms;
+    int prefixFittedRows = 0;
+    GallerySearchMode searchMode = GALLERY_HNSW;
+};
+
+/*
+  One gallery row matched to a query and its L2 distance.
+*/
+struct GalleryMatch {
+    int index;
+    float distance;
+};
+
+void buildEmbeddingGallery(EmbeddingGallery& gallery, const std::vector<TrainingSample>& trainingData);
+void addToEmbeddingGallery(EmbeddingGallery& gallery, const TrainingSample& sample);
+void setGallerySearchMode(EmbeddingGallery& gallery, GallerySearchMode mode, QuantizationReport* report = nullptr);
+bool galleryRowsReleased(const EmbeddingGallery& gallery);
+void galleryEmbeddings(const EmbeddingGallery& gallery, cv::Mat& embeddings);
+const char* gallerySearchModeName(GallerySearchMode mode);
+bool saveGalleryIndex(const EmbeddingGallery& gallery, const std::string& filename);
+bool loadGalleryIndex(EmbeddingGallery& gallery, const std::string& filename);
+void searchEmbeddingGallery(const EmbeddingGallery& gallery, const cv::Mat& queries, int k,
+    std::vector<std::vector<GalleryMatch>>& matches, float maxDistance = std::numeric_limits<float>::max());
+std::vector<ClassificationResult> classifyObjectsCNN(const cv::Mat& queries, const EmbeddingGallery& gallery,
+    float distanceThreshold = 100000.0f);
+ClassificationResult classifyObjectCNN(const std::vector<float>& embedding, const EmbeddingGallery& gallery,
+    const std::vector<std::string>& candidates, float distanceThreshold = 100000.0f);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the pooled CNN input. Each region image goes through one
+  pass that swaps to RGB, subtracts the mean, scales and writes the three
+  channel planes of its slot, the same values blobFromImage produces.
+*/
+
+#include "embeddingInput.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+  Per channel lookup tables of the network's input normalization, in the
+  network's RGB plane order and indexed by the 8 bit pixel value. The mean
+  (124, 116, 104) and the 1 / (255 * 0.226) scale are folded in, so
+  normalizing a pixel is three table reads.
+*/
+struct NormalizationTable {
+    float values[3][256];
+
+    NormalizationTable() {
+        const double mean[3] = { 124.0, 116.0, 104.0 };
+        const double scale = (1.0 / 255.0) * (1 / 0.226);
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                values[c][v] = static_cast<float>((v - mean[c]) * scale);
+            }
+        }
+    }
+};
+
+static const NormalizationTable& normalizationTable() {
+    static const NormalizationTable table;
+    return table;
+}
+
+/*
+  tensor : pooled tensor
+  count : number of regions in this batch
+
+  Makes room for count images, growing the pool only when it is too small,
+  and points the batch header at the first count of them.
+*/
+void beginEmbeddingBatch(EmbeddingTensor& tensor, int count) {
+    const int s = EmbeddingTensor::inputSize;
+    if (count > tensor.capacity) {
+        tensor.input.create(1, count * 3 * s * s, CV_32F);
+        tensor.capacity = count;
+        tensor.count = 0;
+    }
+    if (count != tensor.count) {
+        int shape[4] = { count, 3, s, s };
+        tensor.batch = Mat(4, shape, CV_32F, tensor.input.ptr<float>());
+        tensor.count = count;
+    }
+}
+
+/*
+  tensor : pooled tensor, after beginEmbeddingBatch
+  slot : which image of the batch to write
+  image : region image, CV_8UC3 BGR, ideally already inputSize square
+
+  Writes the normalized CHW planes of the image straight into its slot.
+  Images of another size are resized into the tensor's scratch buffer first,
+  as getEmbedding would.
+*/
+void fillEmbeddingInput(EmbeddingTensor& tensor, int slot, const Mat& image) {
+    const int s = EmbeddingTensor::inputSize;
+    CV_Assert(image.type() == CV_8UC3 && slot >= 0 && slot < tensor.count);
+
+    const Mat* source = &image;
+    if (image.cols != s || image.rows != s) {
+        resize(image, tensor.resized, Size(s, s));
+        source = &tensor.resized;
+    }
+
+    const NormalizationTable& table = normalizationTable();
+    float* red = tensor.input.ptr<float>() + static_cast<size_t>(slot) * 3 * s * s;
+    float* green = red + s * s;
+    float* blue = green + s * s;
+    for (int y = 0; y < s; y++) {
+        const uchar* pixel = source->ptr<uchar>(y);
+        float* r = red + y * s;
+        float* g = green + y * s;
+        float* b = blue + y * s;
+        for (int x = 0; x < s; x++, pixel += 3) {
+            b[x] = table.values[2][pixel[0]];
+            g[x] = table.values[1][pixel[1]];
+            r[x] = table.values[0][pixel[2]];
+        }
+    }
+}
+
+/*
+  tensor : pooled tensor with all of its batch's slots filled
+  net : ResNet 18 embedding network
+
+  Runs one forward pass over the batch. Returns the embeddings, one row per
+  slot. The network copies a same shaped input into its existing input blob
+  and reuses its layer buffers, so once the batch size has been seen there
+  is no allocation on this path.
+*/
+const Mat& runEmbeddingBatch(EmbeddingTensor& tensor, dnn::Net& net) {
+    net.setInput(tensor.batch);
+    net.forward(tensor.output, "onnx_node!resnetv22_flatten0_reshape0");
+    if (tensor.output.rows != tensor.count) {
+        tensor.output = tensor.output.reshape(1, tensor.count);
+    }
+    return tensor.output;
+}
@@ -0,0 +1,37 @@
+/*
+  Nihal Sandadi
+
+  Header file for the pooled CNN input, a reusable batch tensor the region
+  images are normalized into directly so the embedding path doesn't allocate
+  on every inference.
+*/
+
+#ifndef EMBEDDING_INPUT_H
+#define EMBEDDING_INPUT_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+
+/*
+  Network input and output for a batch of regions. input holds capacity
+  images of 3 x inputSize x inputSize floats and only ever grows; batch is a
+  4 dimensional header over its first count images, rebuilt only when count
+  changes. resized is scratch for images that aren't already network sized.
+  output has one embedding per row after runEmbeddingBatch, a view of the
+  network's own output blob that is valid until the next forward pass.
+*/
+struct EmbeddingTensor {
+    static const int inputSize = 224;
+    int capacity = 0;
+    int count = 0;
+    cv::Mat input;
+    cv::Mat batch;
+    cv::Mat resized;
+    cv::Mat output;
+};
+
+void beginEmbeddingBatch(EmbeddingTensor& tensor, int count);
+void fillEmbeddingInput(EmbeddingTensor& tensor, int slot, const cv::Mat& image);
+const cv::Mat& runEmbeddingBatch(EmbeddingTensor& tensor, cv::dnn::Net& net);
+
+#endif
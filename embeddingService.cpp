@@ -0,0 +1,265 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the asynchronous embedding service: a mutex guarded job
+  queue, worker threads that batch jobs through their own network, and the
+  live gallery shared with the frame loop under a reader writer lock.
+*/
+
+#include "embeddingService.h"
+#include "embeddingInput.h"
+#include <algorithm>
+#include <utility>
+
+using namespace cv;
+using namespace std;
+
+/*
+  modelPath : ONNX file of the ResNet 18 embedding network
+  workerCount : number of worker threads, 0 for half the cores (at most 2)
+  queueCapacity : most jobs waiting at once
+  maxBatch : most jobs a worker embeds in one forward pass
+  distanceThreshold : CNN classification threshold
+
+  Loads one copy of the network per worker, cv::dnn::Net isn't safe to share
+  between threads, and starts the workers. Throws if the model can't be
+  loaded.
+*/
+EmbeddingService::EmbeddingService(const string& modelPath, int workerCount, int queueCapacity,
+    int maxBatch, float distanceThreshold)
+    : queueCapacity(max(1, queueCapacity)),
+    maxBatch(max(1, maxBatch)),
+    distanceThreshold(distanceThreshold) {
+
+    if (workerCount <= 0) {
+        workerCount = min(2, max(1, static_cast<int>(thread::hardware_concurrency()) / 2));
+    }
+
+    vector<dnn::Net> nets;
+    for (int w = 0; w < workerCount; w++) {
+        nets.push_back(dnn::readNetFromONNX(modelPath));
+    }
+    for (int w = 0; w < workerCount; w++) {
+        threads.emplace_back(&EmbeddingService::run, this, nets[w]);
+    }
+}
+
+/*
+  Stops the workers once they finish the batches they are on. Jobs still
+  queued are dropped.
+*/
+EmbeddingService::~EmbeddingService() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+        jobs.clear();
+    }
+    jobsReady.notify_all();
+    for (thread& worker : threads) {
+        worker.join();
+    }
+}
+
+/*
+  Whether submit would accept a job now. Check this before preparing a job's
+  image so a full queue costs nothing; with a single submitting thread the
+  answer can't turn false before its submit, workers only free up room.
+*/
+bool EmbeddingService::hasCapacity() {
+    lock_guard<mutex> lock(queueMutex);
+    return static_cast<int>(jobs.size()) < queueCapacity;
+}
+
+/*
+  A job image buffer from one already embedded, to sample the next job into
+  without allocating. Empty until the workers have finished a job.
+*/
+Mat EmbeddingService::acquireImage() {
+    lock_guard<mutex> lock(queueMutex);
+    if (freeImages.empty()) {
+        return Mat();
+    }
+    Mat image = std::move(freeImages.back());
+    freeImages.pop_back();
+    return image;
+}
+
+/*
+  job : region to embed, moved into the queue
+
+  Queues the job for the next free worker. Returns false without queueing it
+  if the queue is full, keeping its image for the next acquireImage.
+*/
+bool EmbeddingService::submit(EmbeddingJob&& job) {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (static_cast<int>(jobs.size()) >= queueCapacity) {
+            freeImages.push_back(std::move(job.image));
+            return false;
+        }
+        jobs.push_back(std::move(job));
+    }
+    jobsReady.notify_one();
+    return true;
+}
+
+/*
+  gallery : CNN gallery to classify against from now on, must outlive the service
+  revision : training revision the gallery belongs to
+
+  Points the workers at the gallery. Nothing is copied, so this is cheap
+  whatever the gallery's size. Batches already running finish against the
+  gallery they started with and report its revision.
+*/
+void EmbeddingService::setGallery(const EmbeddingGallery& gallery, int revision) {
+    lock_guard<mutex> lock(queueMutex);
+    this->gallery = &gallery;
+    galleryRevision = revision;
+}
+
+/*
+  Waits for workers classifying against a gallery to finish and keeps them
+  out until the returned lock is released, so the caller can change the
+  galleries they read. Classifying a batch is short next to its forward
+  pass, which runs outside the lock.
+*/
+unique_lock<shared_mutex> EmbeddingService::editGallery() {
+    return unique_lock<shared_mutex>(galleryMutex);
+}
+
+/*
+  finished : the results collected last time on input, the jobs completed since on output
+
+  Takes back the previous results, keeping their buffers for the workers to
+  fill again, and hands over the finished ones, leaving the service's list
+  empty.
+*/
+void EmbeddingService::collectResults(vector<EmbeddingResult>& finished) {
+    lock_guard<mutex> lock(queueMutex);
+    for (EmbeddingResult& spare : finished) {
+        spareResults.push_back(std::move(spare));
+    }
+    finished.clear();
+    finished.swap(results);
+}
+
+/*
+  net : this worker's own network
+
+  Worker loop. Takes up to maxBatch jobs, embeds them in one forward pass,
+  classifies the batch against the current gallery, in one batched search
+  for the jobs without candidates and among its candidates' rows for each
+  of the others, and publishes the results, until the service is
+  destroyed. The results are filled in spare ones handed back through
+  collectResults, and the job images go back on the free list, so their
+  buffers are reused; the batch, the query matrix and the rest are kept
+  across batches.
+*/
+void EmbeddingService::run(dnn::Net net) {
+    EmbeddingTensor tensor;
+    vector<EmbeddingJob> batch;
+    vector<EmbeddingResult> finished;
+    vector<int> unrestricted;
+    Mat queries;
+
+    while (true) {
+        const EmbeddingGallery* target;
+        int revision;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            jobsReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+
+            batch.clear();
+            while (!jobs.empty() && static_cast<int>(batch.size()) < maxBatch) {
+                batch.push_back(std::move(jobs.front()));
+                jobs.pop_front();
+            }
+            target = gallery;
+            revision = galleryRevision;
+
+            finished.resize(batch.size());
+            for (EmbeddingResult& result : finished) {
+                if (!spareResults.empty()) {
+                    result = std::move(spareResults.back());
+                    spareResults.pop_back();
+                }
+            }
+        }
+
+        for (int j = 0; j < static_cast<int>(batch.size()); j++) {
+            finished[j].trackId = batch[j].trackId;
+            finished[j].box = batch[j].box;
+            finished[j].candidates = std::move(batch[j].candidates);
+            finished[j].embedding.clear();
+            finished[j].revision = -1;
+        }
+
+        try {
+            beginEmbeddingBatch(tensor, static_cast<int>(batch.size()));
+            for (int j = 0; j < static_cast<int>(batch.size()); j++) {
+                fillEmbeddingInput(tensor, j, batch[j].image);
+            }
+            const Mat& embeddings = runEmbeddingBatch(tensor, net);
+
+            for (int j = 0; j < static_cast<int>(batch.size()); j++) {
+                finished[j].embedding.assign(embeddings.ptr<float>(j), embeddings.ptr<float>(j) + embeddings.cols);
+            }
+
+            if (target) {
+                shared_lock<shared_mutex> reading(galleryMutex);
+                if (!target->labels.empty()) {
+                    unrestricted.clear();
+                    for (int j = 0; j < static_cast<int>(batch.size()); j++) {
+                        if (finished[j].candidates.empty()) {
+                            unrestricted.push_back(j);
+                        }
+                        else {
+                            finished[j].result = classifyObjectCNN(finished[j].embedding, *target,
+                                finished[j].candidates, distanceThreshold);
+                        }
+                    }
+
+                    if (unrestricted.size() == batch.size()) {
+                        vector<ClassificationResult> classified = classifyObjectsCNN(embeddings, *target, distanceThreshold);
+                        for (int j = 0; j < static_cast<int>(batch.size()); j++) {
+                            finished[j].result = classified[j];
+                        }
+                    }
+                    else if (!unrestricted.empty()) {
+                        queries.create(static_cast<int>(unrestricted.size()), embeddings.cols, CV_32F);
+                        for (int q = 0; q < static_cast<int>(unrestricted.size()); q++) {
+                            embeddings.row(unrestricted[q]).copyTo(queries.row(q));
+                        }
+                        vector<ClassificationResult> classified = classifyObjectsCNN(queries, *target, distanceThreshold);
+                        for (int q = 0; q < static_cast<int>(unrestricted.size()); q++) {
+                            finished[unrestricted[q]].result = classified[q];
+                        }
+                    }
+
+                    // only now that every result is in place do they count as classified
+                    for (EmbeddingResult& result : finished) {
+                        result.revision = revision;
+                    }
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            // results go out unclassified, and with empty embeddings if the network failed so the
+            // tracks can be resubmitted
+            for (EmbeddingResult& result : finished) {
+                result.revision = -1;
+            }
+        }
+
+        lock_guard<mutex> lock(queueMutex);
+        for (EmbeddingResult& result : finished) {
+            results.push_back(std::move(result));
+        }
+        for (EmbeddingJob& job : batch) {
+            freeImages.push_back(std::move(job.image));
+        }
+    }
+}
@@ -0,0 +1,104 @@
+/*
+  Nihal Sandadi
+
+  Header file for the asynchronous embedding service, which runs the CNN on
+  worker threads so the capture, segmentation and display loop never waits
+  for a forward pass.
+*/
+
+#ifndef EMBEDDING_SERVICE_H
+#define EMBEDDING_SERVICE_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include "embeddingGallery.h"
+#include "classification.h"
+
+/*
+  One region to embed: the track it belongs to, its oriented box and the
+  region already sampled at network size with prepEmbeddingInput. The image
+  is owned by the job, the camera reuses the frame buffer so workers can't
+  read from the frame itself; start it from acquireImage so a recycled
+  buffer is sampled into. candidates restricts the classification to those
+  labels, as the cascade asks; empty means all labels.
+*/
+struct EmbeddingJob {
+    int trackId;
+    cv::RotatedRect box;
+    cv::Mat image;
+    std::vector<std::string> candidates;
+};
+
+/*
+  A finished job. embedding is empty if the network failed on it. result is
+  the classification among the job's candidates against the gallery of
+  training revision revision, or revision is -1 if there was no gallery to
+  classify against. Swap the embedding and candidates out rather than
+  copying them; whatever the results hold when they are handed back to
+  collectResults is reused for later ones.
+*/
+struct EmbeddingResult {
+    int trackId;
+    cv::RotatedRect box;
+    std::vector<float> embedding;
+    ClassificationResult result;
+    std::vector<std::string> candidates;
+    int revision;
+};
+
+/*
+  Bounded job queue served by worker threads, each with its own copy of the
+  network and its own input tensor. Workers take up to maxBatch queued jobs
+  at a time, embed them in one forward pass and classify them against the
+  gallery last passed to setGallery, read in place under a shared lock
+  rather than copied. Whoever owns the gallery must hold editGallery's lock
+  while changing it. submit never blocks, it refuses jobs when the queue is
+  full, so a slow network drops work instead of slowing the frame loop.
+  Job images and results are recycled through freeImages and spareResults,
+  so once running the service embeds without allocating; both only ever
+  hold as many as were in flight at once.
+*/
+class EmbeddingService {
+public:
+    EmbeddingService(const std::string& modelPath, int workerCount = 0, int queueCapacity = 16,
+        int maxBatch = 8, float distanceThreshold = 100000.0f);
+    ~EmbeddingService();
+
+    EmbeddingService(const EmbeddingService&) = delete;
+    EmbeddingService& operator=(const EmbeddingService&) = delete;
+
+    int workers() const { return static_cast<int>(threads.size()); }
+    bool hasCapacity();
+    cv::Mat acquireImage();
+    bool submit(EmbeddingJob&& job);
+    void setGallery(const EmbeddingGallery& gallery, int revision);
+    std::unique_lock<std::shared_mutex> editGallery();
+    void collectResults(std::vector<EmbeddingResult>& finished);
+
+private:
+    void run(cv::dnn::Net net);
+
+    int queueCapacity;
+    int maxBatch;
+    float distanceThreshold;
+    bool stopping = false;
+    std::deque<EmbeddingJob> jobs;
+    std::vector<EmbeddingResult> results;
+    std::vector<cv::Mat> freeImages;
+    std::vector<EmbeddingResult> spareResults;
+    const EmbeddingGallery* gallery = nullptr;
+    int galleryRevision = -1;
+    std::mutex queueMutex;
+    std::shared_mutex galleryMutex;
+    std::condition_variable jobsReady;
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the classic feature KD-tree: balanced builds on the
+  widest scaled axis, leaf insertion for new samples and exact k nearest
+  neighbour search with the model's feature scaling.
+*/
+
+#include "featureTree.h"
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <cmath>
+
+using namespace std;
+
+/*
+  tree : tree being built
+  model : model the rows come from
+  rows : row numbers to place, reordered in place
+  first, last : range of rows for this subtree
+
+  Builds a balanced subtree, splitting at the median of the axis along which
+  the rows are most spread out once scaled. Returns the subtree's root node.
+*/
+static int buildSubtree(FeatureTree& tree, const ClassicModel& model, vector<int>& rows, int first, int last) {
+    const int n = ClassicModel::featureCount;
+    if (first >= last) {
+        return -1;
+    }
+
+    int axis = 0;
+    double widest = -1.0;
+    for (int i = 0; i < n; i++) {
+        double low = numeric_limits<double>::max();
+        double high = -numeric_limits<double>::max();
+        for (int r = first; r < last; r++) {
+            double value = model.rawFeatures[rows[r] * n + i];
+            low = min(low, value);
+            high = max(high, value);
+        }
+        double spread = (high - low) * model.scale[i];
+        if (spread > widest) {
+            widest = spread;
+            axis = i;
+        }
+    }
+
+    int middle = first + (last - first) / 2;
+    nth_element(rows.begin() + first, rows.begin() + middle, rows.begin() + last, [&](int a, int b) {
+        return model.rawFeatures[a * n + axis] < model.rawFeatures[b * n + axis];
+    });
+
+    int index = static_cast<int>(tree.nodes.size());
+    FeatureTree::Node node;
+    copy(&model.rawFeatures[rows[middle] * n], &model.rawFeatures[rows[middle] * n] + n, node.point);
+    node.row = rows[middle];
+    node.axis = axis;
+    tree.nodes.push_back(node);
+
+    int left = buildSubtree(tree, model, rows, first, middle);
+    int right = buildSubtree(tree, model, rows, middle + 1, last);
+    tree.nodes[index].left = left;
+    tree.nodes[index].right = right;
+    return index;
+}
+
+/*
+  tree : tree to fill
+  model : classic model whose rows to index
+
+  Builds a balanced tree over all of the model's rows.
+*/
+void buildFeatureTree(FeatureTree& tree, const ClassicModel& model) {
+    int rows = static_cast<int>(model.labels.size());
+    tree.nodes.clear();
+    tree.nodes.reserve(rows);
+    vector<int> order(rows);
+    for (int r = 0; r < rows; r++) {
+        order[r] = r;
+    }
+    tree.root = buildSubtree(tree, model, order, 0, rows);
+    tree.balancedSize = rows;
+}
+
+/*
+  tree : tree built from an earlier state of the model
+  model : classic model, possibly with rows added since
+
+  Brings the tree up to date. Rows added since the last call are inserted as
+  new leaves, alternating the split axis with depth; once the tree has
+  doubled since its last balanced build, or the model was rebuilt with
+  fewer rows, it is rebuilt balanced.
+*/
+void syncFeatureTree(FeatureTree& tree, const ClassicModel& model) {
+    const int n = ClassicModel::featureCount;
+    int rows = static_cast<int>(model.labels.size());
+    if (rows < static_cast<int>(tree.nodes.size()) || rows >= 2 * max(tree.balancedSize, 8)) {
+        buildFeatureTree(tree, model);
+        return;
+    }
+
+    for (int r = static_cast<int>(tree.nodes.size()); r < rows; r++) {
+        FeatureTree::Node node;
+        copy(&model.rawFeatures[r * n], &model.rawFeatures[r * n] + n, node.point);
+        node.row = r;
+        node.axis = 0;
+        node.left = -1;
+        node.right = -1;
+
+        int index = static_cast<int>(tree.nodes.size());
+        if (tree.root < 0) {
+            tree.nodes.push_back(node);
+            tree.root = index;
+            continue;
+        }
+
+        int parent = tree.root;
+        while (true) {
+            FeatureTree::Node& current = tree.nodes[parent];
+            int& child = (node.point[current.axis] < current.point[current.axis]) ? current.left : current.right;
+            if (child < 0) {
+                node.axis = (current.axis + 1) % n;
+                child = index;
+                break;
+            }
+            parent = child;
+        }
+        tree.nodes.push_back(node);
+    }
+}
+
+/*
+  tree, model : tree and the model it indexes
+  query : raw query features
+  k : number of neighbours wanted
+  node : subtree to search
+  nearest : max heap of the best (scaled squared distance, row) found so far
+
+  Depth first search visiting the side of each split the query falls on
+  first, and the other side only if the split plane is closer than the
+  current kth best.
+*/
+static void searchSubtree(const FeatureTree& tree, const ClassicModel& model, const double* query, int k,
+    int node, priority_queue<pair<double, int>>& nearest) {
+    const int n = ClassicModel::featureCount;
+    if (node < 0) {
+        return;
+    }
+
+    const FeatureTree::Node& current = tree.nodes[node];
+    double squared = 0.0;
+    for (int i = 0; i < n; i++) {
+        double d = (query[i] - current.point[i]) * model.scale[i];
+        squared += d * d;
+    }
+    if (static_cast<int>(nearest.size()) < k) {
+        nearest.push({ squared, current.row });
+    }
+    else if (squared < nearest.top().first) {
+        nearest.pop();
+        nearest.push({ squared, current.row });
+    }
+
+    double offset = (query[current.axis] - current.point[current.axis]) * model.scale[current.axis];
+    int nearSide = (offset < 0) ? current.left : current.right;
+    int farSide = (offset < 0) ? current.right : current.left;
+    searchSubtree(tree, model, query, k, nearSide, nearest);
+    if (static_cast<int>(nearest.size()) < k || offset * offset < nearest.top().first) {
+        searchSubtree(tree, model, query, k, farSide, nearest);
+    }
+}
+
+/*
+  tree : tree built over model
+  model : classic model supplying the rows' scaling
+  features : raw query features, featureCount of them
+  k : number of neighbours wanted
+  nearest : output, up to k (scaled squared distance, row) pairs nearest first
+
+  Exact k nearest neighbour search, with distances measured the same way as
+  the linear classifier's.
+*/
+void searchFeatureTree(const FeatureTree& tree, const ClassicModel& model, const double* features, int k,
+    vector<pair<double, int>>& nearest) {
+    nearest.clear();
+    if (tree.root < 0 || k <= 0) {
+        return;
+    }
+
+    priority_queue<pair<double, int>> heap;
+    searchSubtree(tree, model, features, k, tree.root, heap);
+    nearest.resize(heap.size());
+    for (int i = static_cast<int>(heap.size()) - 1; i >= 0; i--) {
+        nearest[i] = heap.top();
+        heap.pop();
+    }
+}
+
+/*
+  features : vector of 4 classic features from region analysis
+  model : compiled training set
+  tree : tree over the model's rows, up to date with syncFeatureTree
+  distanceThreshold : maximum allowed distance
+
+  Same result as classifying against the model directly, found through the
+  tree. Falls back to the linear scan if the tree is behind the model.
+*/
+ClassificationResult classifyObject(const vector<double>& features, const ClassicModel& model,
+    const FeatureTree& tree, double distanceThreshold) {
+    if (tree.nodes.size() != model.labels.size() || features.size() < ClassicModel::featureCount) {
+        return classifyObject(features, model, distanceThreshold);
+    }
+
+    ClassificationResult result;
+    vector<pair<double, int>> nearest;
+    searchFeatureTree(tree, model, features.data(), 1, nearest);
+    if (nearest.empty()) {
+        result.label = "Unknown";
+        result.distance = numeric_limits<double>::max();
+        result.isUnknown = true;
+        return result;
+    }
+
+    double adjustedThreshold = distanceThreshold * 1.5;
+    result.label = model.labels[nearest[0].second];
+    result.distance = sqrt(nearest[0].first);
+    result.isUnknown = (result.distance > adjustedThreshold);
+    return result;
+}
@@ -0,0 +1,43 @@
+/*
+  Nihal Sandadi
+
+  Header file for the KD-tree over the classic features, so finding the
+  nearest training samples takes logarithmic rather than linear time.
+*/
+
+#ifndef FEATURE_TREE_H
+#define FEATURE_TREE_H
+
+#include <vector>
+#include <utility>
+#include "classification.h"
+
+/*
+  KD-tree over a ClassicModel's raw feature rows. Splits are on raw values
+  and the model's per feature scales are applied while searching, so the
+  tree stays valid when adding a sample changes the spreads. New rows are
+  inserted below the existing leaves and the whole tree is rebuilt balanced
+  once it has doubled since the last build, keeping insertion amortized
+  logarithmic too.
+*/
+struct FeatureTree {
+    struct Node {
+        double point[ClassicModel::featureCount];
+        int row;
+        int axis;
+        int left;
+        int right;
+    };
+    std::vector<Node> nodes;
+    int root = -1;
+    int balancedSize = 0;
+};
+
+void buildFeatureTree(FeatureTree& tree, const ClassicModel& model);
+void syncFeatureTree(FeatureTree& tree, const ClassicModel& model);
+void searchFeatureTree(const FeatureTree& tree, const ClassicModel& model, const double* features, int k,
+    std::vector<std::pair<double, int>>& nearest);
+ClassificationResult classifyObject(const std::vector<double>& features, const ClassicModel& model,
+    const FeatureTree& tree, double distanceThreshold = 2.0);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the HNSW index: layered greedy search, neighbour
+  selection by the diversity heuristic and a plain binary file format.
+*/
+
+#include "hnswIndex.h"
+#include "distanceKernels.h"
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+
+// file header, bumped whenever the layout changes
+static const uint32_t hnswMagic = 0x57534E48;
+static const uint32_t hnswVersion = 3;
+// largest link count or candidate list size accepted from a file
+static const int maxHnswParameter = 4096;
+
+/*
+  maxConnections : links per node on the upper layers
+  efConstruction : candidate list size while inserting
+  efSearch : candidate list size while searching
+
+  Creates an empty index. Node levels are drawn with a fixed seed so the same
+  insertions always build the same graph.
+*/
+HnswIndex::HnswIndex(int maxConnections, int efConstruction, int efSearch)
+    : maxConnections(max(2, maxConnections)),
+    efConstruction(max(1, efConstruction)),
+    efSearch(max(1, efSearch)),
+    levelScale(1.0 / log(static_cast<double>(max(2, maxConnections)))),
+    levelGenerator(100) {
+}
+
+/*
+  Removes every vector, keeping the parameters.
+*/
+void HnswIndex::clear() {
+    dim = 0;
+    entryPoint = -1;
+    topLevel = -1;
+    levels.clear();
+    links.clear();
+    levelGenerator.seed(100);
+}
+
+float HnswIndex::distance(const HnswVectors& vectors, const float* a, int id) const {
+    return squaredL2Distance(a, vectors.at(id), dim);
+}
+
+/*
+  vectors : the indexed vectors
+  query : vector being searched for or inserted
+  entry : node to start from on fromLevel
+  fromLevel : highest layer to walk
+  toLevel : layer to stop above
+
+  Walks each layer from fromLevel down to toLevel + 1, always moving to the
+  closest neighbour, and returns the node it ends on.
+*/
+int HnswIndex::greedyDescend(const HnswVectors& vectors, const float* query, int entry, int fromLevel, int toLevel) const {
+    int current = entry;
+    float currentDistance = distance(vectors, query, current);
+    for (int level = fromLevel; level > toLevel; level--) {
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (int neighbor : links[current][level]) {
+                float d = distance(vectors, query, neighbor);
+                if (d < currentDistance) {
+                    currentDistance = d;
+                    current = neighbor;
+                    moved = true;
+                }
+            }
+        }
+    }
+    return current;
+}
+
+/*
+  vectors : the indexed vectors
+  query : vector being searched for or inserted
+  entry : node to start from
+  ef : how many of the closest nodes to keep
+  level : layer to search
+  found : output, up to ef nodes nearest first as (squared distance, id)
+
+  Best first search of one layer. Visited nodes are marked with a per thread
+  generation counter so nothing has to be cleared between searches.
+*/
+void HnswIndex::searchLayer(const HnswVectors& vectors, const float* query, int entry, int ef, int level,
+    vector<Candidate>& found) const {
+    thread_local vector<unsigned> visitedMarks;
+    thread_local unsigned visitGeneration = 0;
+    if (visitedMarks.size() < levels.size()) {
+        visitedMarks.resize(levels.size(), 0);
+    }
+    if (++visitGeneration == 0) {
+        fill(visitedMarks.begin(), visitedMarks.end(), 0);
+        visitGeneration = 1;
+    }
+
+    priority_queue<Candidate, vector<Candidate>, greater<Candidate>> frontier;
+    priority_queue<Candidate> nearest;
+
+    float entryDistance = distance(vectors, query, entry);
+    frontier.push({ entryDistance, entry });
+    nearest.push({ entryDistance, entry });
+    visitedMarks[entry] = visitGeneration;
+
+    while (!frontier.empty()) {
+        Candidate closest = frontier.top();
+        if (closest.first > nearest.top().first && static_cast<int>(nearest.size()) >= ef) {
+            break;
+        }
+        frontier.pop();
+
+        for (int neighbor : links[closest.second][level]) {
+            if (visitedMarks[neighbor] == visitGeneration) {
+                continue;
+            }
+            visitedMarks[neighbor] = visitGeneration;
+
+            float d = distance(vectors, query, neighbor);
+            if (static_cast<int>(nearest.size()) < ef || d < nearest.top().first) {
+                frontier.push({ d, neighbor });
+                nearest.push({ d, neighbor });
+                if (static_cast<int>(nearest.size()) > ef) {
+                    nearest.pop();
+                }
+            }
+        }
+    }
+
+    found.resize(nearest.size());
+    for (int i = static_cast<int>(nearest.size()) - 1; i >= 0; i--) {
+        found[i] = nearest.top();
+        nearest.pop();
+    }
+}
+
+/*
+  vectors : the indexed vectors
+  candidates : possible neighbours nearest first, trimmed to the chosen ones
+  count : maximum number of neighbours
+
+  Keeps a candidate only if it is closer to the node being linked than to
+  every neighbour already kept, which spreads the links in different
+  directions instead of spending them all on one tight cluster. Leftover
+  slots are then filled with the closest rejected candidates so small
+  galleries stay well connected.
+*/
+void HnswIndex::selectNeighbors(const HnswVectors& vectors, vector<Candidate>& candidates, int count) const {
+    if (static_cast<int>(candidates.size()) <= count) {
+        return;
+    }
+
+    vector<Candidate> kept;
+    vector<Candidate> rejected;
+    for (const auto& candidate : candidates) {
+        if (static_cast<int>(kept.size()) >= count) {
+            break;
+        }
+        bool diverse = true;
+        for (const auto& other : kept) {
+            if (squaredL2Distance(vectors.at(candidate.second), vectors.at(other.second), dim) < candidate.first) {
+                diverse = false;
+                break;
+            }
+        }
+        if (diverse) {
+            kept.push_back(candidate);
+        }
+        else {
+            rejected.push_back(candidate);
+        }
+    }
+    for (int i = 0; i < static_cast<int>(rejected.size()) && static_cast<int>(kept.size()) < count; i++) {
+        kept.push_back(rejected[i]);
+    }
+    candidates.swap(kept);
+}
+
+/*
+  vectors : the indexed vectors, including the new one as vector size()
+  length : number of floats per vector, must match the vectors already added
+
+  Inserts vector size() and returns its id, or -1 if its length doesn't
+  match. The node gets a random top layer, is linked on each layer it lives
+  on to neighbours found with efConstruction candidates, and neighbours
+  that end up with too many links are pruned with the same heuristic.
+*/
+int HnswIndex::add(const HnswVectors& vectors, int length) {
+    if (length <= 0 || (dim != 0 && length != dim)) {
+        return -1;
+    }
+    dim = length;
+
+    int id = size();
+    uniform_real_distribution<double> uniform(numeric_limits<double>::min(), 1.0);
+    int level = static_cast<int>(-log(uniform(levelGenerator)) * levelScale);
+
+    levels.push_back(level);
+    links.emplace_back(level + 1);
+    const float* query = vectors.at(id);
+
+    if (entryPoint < 0) {
+        entryPoint = id;
+        topLevel = level;
+        return id;
+    }
+
+    int entry = greedyDescend(vectors, query, entryPoint, topLevel, level);
+    vector<Candidate> candidates;
+    for (int layer = min(level, topLevel); layer >= 0; layer--) {
+        searchLayer(vectors, query, entry, efConstruction, layer, candidates);
+        entry = candidates[0].second;
+
+        vector<Candidate> selected = candidates;
+        selectNeighbors(vectors, selected, maxConnections);
+        for (const auto& neighbor : selected) {
+            links[id][layer].push_back(neighbor.second);
+        }
+
+        for (const auto& neighbor : selected) {
+            vector<int>& neighborLinks = links[neighbor.second][layer];
+            neighborLinks.push_back(id);
+            if (static_cast<int>(neighborLinks.size()) <= levelCapacity(layer)) {
+                continue;
+            }
+
+            const float* neighborVector = vectors.at(neighbor.second);
+            vector<Candidate> relinked;
+            for (int other : neighborLinks) {
+                relinked.push_back({ distance(vectors, neighborVector, other), other });
+            }
+            sort(relinked.begin(), relinked.end());
+            selectNeighbors(vectors, relinked, levelCapacity(layer));
+            neighborLinks.clear();
+            for (const auto& other : relinked) {
+                neighborLinks.push_back(other.second);
+            }
+        }
+    }
+
+    if (level > topLevel) {
+        entryPoint = id;
+        topLevel = level;
+    }
+    return id;
+}
+
+/*
+  vectors : the indexed vectors
+  query : vector to search for, dimension() floats
+  k : number of neighbours wanted
+  nearest : output, up to k (squared distance, id) pairs nearest first
+
+  Greedy descent to the bottom layer, then a best first search there with
+  max(efSearch, k) candidates.
+*/
+void HnswIndex::search(const HnswVectors& vectors, const float* query, int k, vector<pair<float, int>>& nearest) const {
+    nearest.clear();
+    if (entryPoint < 0 || k <= 0) {
+        return;
+    }
+
+    int entry = greedyDescend(vectors, query, entryPoint, topLevel, 0);
+    searchLayer(vectors, query, entry, max(efSearch, k), 0, nearest);
+    if (static_cast<int>(nearest.size()) > k) {
+        nearest.resize(k);
+    }
+}
+
+/*
+  filename : path to write the index to
+  fingerprint : caller's identification of the vectors, stored in the header
+
+  Writes the parameters and links as a binary file so a large gallery
+  doesn't have to be re-indexed at startup. The vectors aren't part of the
+  index and aren't written; the fingerprint is how a later load can tell
+  whether the graph was built over the same ones.
+*/
+bool HnswIndex::save(const string& filename, uint64_t fingerprint) const {
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cout << "Error: Could not open file " << filename << " for writing" << endl;
+        return false;
+    }
+
+    auto writeInt = [&](int32_t value) { file.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    writeInt(hnswMagic);
+    writeInt(hnswVersion);
+    file.write(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+    writeInt(maxConnections);
+    writeInt(efConstruction);
+    writeInt(efSearch);
+    writeInt(dim);
+    writeInt(size());
+    writeInt(entryPoint);
+    writeInt(topLevel);
+    for (int id = 0; id < size(); id++) {
+        writeInt(levels[id]);
+        for (const auto& layerLinks : links[id]) {
+            writeInt(static_cast<int32_t>(layerLinks.size()));
+            file.write(reinterpret_cast<const char*>(layerLinks.data()), layerLinks.size() * sizeof(int));
+        }
+    }
+    return file.good();
+}
+
+/*
+  filename : path of an index written by save
+  fingerprint : output if not null, the fingerprint it was saved with
+
+  Replaces this index with the one in the file. Returns false and leaves the
+  index empty if the file is missing or isn't a valid index: truncated, an
+  entry point that isn't a node on the top layer, a node or link count out
+  of range, or a link to a node that doesn't exist. The parameters are
+  clamped to the same ranges the constructor allows, and to
+  maxHnswParameter.
+*/
+bool HnswIndex::load(const string& filename, uint64_t* fingerprint) {
+    clear();
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    auto readInt = [&]() {
+        int32_t value = 0;
+        file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    };
+    if (readInt() != static_cast<int32_t>(hnswMagic) || readInt() != static_cast<int32_t>(hnswVersion)) {
+        cout << "Error: " << filename << " is not an HNSW index" << endl;
+        return false;
+    }
+    uint64_t savedFingerprint = 0;
+    file.read(reinterpret_cast<char*>(&savedFingerprint), sizeof(savedFingerprint));
+
+    maxConnections = min(maxHnswParameter, max(2, static_cast<int>(readInt())));
+    efConstruction = min(maxHnswParameter, max(1, static_cast<int>(readInt())));
+    efSearch = min(maxHnswParameter, max(1, static_cast<int>(readInt())));
+    levelScale = 1.0 / log(static_cast<double>(maxConnections));
+    dim = readInt();
+    int count = readInt();
+    entryPoint = readInt();
+    topLevel = readInt();
+    bool emptyGraph = (count == 0 && entryPoint == -1 && topLevel == -1);
+    bool validEntry = (count > 0 && entryPoint >= 0 && entryPoint < count && topLevel >= 0);
+    if (!file || dim < 0 || count < 0 || !(emptyGraph || validEntry)) {
+        cout << "Error: " << filename << " has an invalid header" << endl;
+        clear();
+        return false;
+    }
+
+    levels.resize(count);
+    links.resize(count);
+    for (int id = 0; id < count && file; id++) {
+        levels[id] = readInt();
+        if (levels[id] < 0 || levels[id] > topLevel) {
+            file.setstate(ios::failbit);
+            break;
+        }
+        links[id].resize(levels[id] + 1);
+        for (int level = 0; level <= levels[id] && file; level++) {
+            vector<int>& layerLinks = links[id][level];
+            int linkCount = readInt();
+            if (linkCount < 0 || linkCount > count || linkCount > levelCapacity(level)) {
+                file.setstate(ios::failbit);
+                break;
+            }
+            layerLinks.resize(linkCount);
+            file.read(reinterpret_cast<char*>(layerLinks.data()), linkCount * sizeof(int));
+            for (int neighbor : layerLinks) {
+                if (neighbor < 0 || neighbor >= count) {
+                    file.setstate(ios::failbit);
+                }
+            }
+        }
+    }
+
+    if (file && count > 0 && levels[entryPoint] != topLevel) {
+        file.setstate(ios::failbit);
+    }
+    if (!file) {
+        cout << "Error: " << filename << " is truncated or corrupt" << endl;
+        clear();
+        return false;
+    }
+    if (fingerprint) {
+        *fingerprint = savedFingerprint;
+    }
+    return true;
+}
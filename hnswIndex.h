@@ -0,0 +1,76 @@
+/*
+  Nihal Sandadi
+
+  Header file for the HNSW (hierarchical navigable small world) approximate
+  nearest neighbour index over CNN embeddings, for galleries too large to
+  scan every frame.
+*/
+
+#ifndef HNSW_INDEX_H
+#define HNSW_INDEX_H
+
+#include <vector>
+#include <string>
+#include <random>
+#include <utility>
+#include <cstdint>
+
+/*
+  Where the indexed vectors live, vector id starting id * stride floats
+  past base. The index only holds the graph. The caller owns
+  the vectors, normally the rows of the gallery matrix, and passes them to
+  every call since that matrix moves as it grows.
+*/
+struct HnswVectors {
+    const float* base;
+    size_t stride;
+    const float* at(int id) const { return base + static_cast<size_t>(id) * stride; }
+};
+
+/*
+  Layered proximity graph over squared L2 distance. Vectors are numbered in
+  the order they are added. maxConnections is the number of links per node
+  on the upper layers (twice that on the bottom one), efConstruction the
+  candidate list size while inserting and efSearch while searching. Larger
+  values give better recall for more time; efSearch can be changed at any
+  point.
+*/
+class HnswIndex {
+public:
+    HnswIndex(int maxConnections = 16, int efConstruction = 200, int efSearch = 64);
+
+    void clear();
+    int size() const { return static_cast<int>(levels.size()); }
+    int dimension() const { return dim; }
+    int getEfSearch() const { return efSearch; }
+    void setEfSearch(int ef) { efSearch = ef; }
+
+    int add(const HnswVectors& vectors, int length);
+    void search(const HnswVectors& vectors, const float* query, int k, std::vector<std::pair<float, int>>& nearest) const;
+
+    bool save(const std::string& filename, uint64_t fingerprint = 0) const;
+    bool load(const std::string& filename, uint64_t* fingerprint = nullptr);
+
+private:
+    typedef std::pair<float, int> Candidate;
+
+    float distance(const HnswVectors& vectors, const float* a, int id) const;
+    int greedyDescend(const HnswVectors& vectors, const float* query, int entry, int fromLevel, int toLevel) const;
+    void searchLayer(const HnswVectors& vectors, const float* query, int entry, int ef, int level,
+        std::vector<Candidate>& found) const;
+    void selectNeighbors(const HnswVectors& vectors, std::vector<Candidate>& candidates, int count) const;
+    int levelCapacity(int level) const { return level == 0 ? 2 * maxConnections : maxConnections; }
+
+    int maxConnections;
+    int efConstruction;
+    int efSearch;
+    double levelScale;
+    int dim = 0;
+    int entryPoint = -1;
+    int topLevel = -1;
+    std::vector<int> levels;
+    std::vector<std::vector<std::vector<int>>> links;
+    std::mt19937 levelGenerator;
+};
+
+#endif
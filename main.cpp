@@ -8,12 +8,22 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <shared_mutex>
 #include "thresholding.h"
+#include "backgroundModel.h"
 #include "morphological.h"
 #include "regionAnalysis.h"
 #include "regionFeatures.h"
 #include "trainingData.h"
 #include "classification.h"
+#include "tracking.h"
+#include "distanceKernels.h"
+#include "embeddingGallery.h"
+#include "prototypes.h"
+#include "featureTree.h"
+#include "embeddingInput.h"
+#include "embeddingService.h"
 #include "utilities.h"
 #include <opencv2/dnn.hpp>
 
@@ -30,11 +40,44 @@ string getLabelFromUser() {
     return label;
 }
 
+/*
+  classicModel : classic model of the full training set
+  embeddingGallery : CNN gallery of the full training set
+  perLabel : most prototypes per label
+  classicPrototypes : output, classic feature prototypes
+  classicPrototypeTree : output, KD-tree over the classic prototypes
+  embeddingPrototypes : output, CNN embedding prototypes
+
+  Rebuilds both prototype sets from the training set and prints how many of
+  the training samples each set still classifies correctly.
+*/
+void rebuildPrototypes(const ClassicModel& classicModel, const EmbeddingGallery& embeddingGallery, int perLabel,
+    ClassicModel& classicPrototypes, FeatureTree& classicPrototypeTree, EmbeddingGallery& embeddingPrototypes) {
+    buildClassicPrototypes(classicModel, perLabel, classicPrototypes);
+    buildFeatureTree(classicPrototypeTree, classicPrototypes);
+    buildEmbeddingPrototypes(embeddingGallery, perLabel, embeddingPrototypes);
+    cout << "Prototypes: " << classicPrototypes.labels.size() << " classic (from " << classicModel.labels.size()
+        << "), " << embeddingPrototypes.labels.size() << " CNN (from " << embeddingGallery.labels.size() << ")" << endl;
+    cout << "  training set agreement: classic " << classicPrototypeAgreement(classicModel, classicPrototypes) * 100.0
+        << "%, CNN " << embeddingPrototypeAgreement(embeddingGallery, embeddingPrototypes) * 100.0 << "%" << endl;
+}
+
+/*
+  service : embedding service, or null if the network didn't load
+
+  Lock to hold while changing a gallery the service's workers may be
+  reading. Empty when there is no service.
+*/
+unique_lock<shared_mutex> lockGalleries(EmbeddingService* service) {
+    return service ? service->editGallery() : unique_lock<shared_mutex>();
+}
+
 /*
   Main loop which is in charge of the windows and processing the video feed
 */
 int main() {
     Mat frame, thresholded, cleaned, regionMap, featureDisplay;
+    BinaryMask thresholdedMask, cleanedMask;
     int mode = 0;
     bool useMorphologicalClean = true;
     bool showRegionAnalysis = true;
@@ -44,10 +87,37 @@ int main() {
     bool waitingForLabelInput = false;
     int minArea = 1000;
     int maxRegions = 5;
+    ThresholdTracker thresholdTracker;
+    BackgroundModel backgroundModel;
+    MorphologyEngine morphology;
     // this is for classic feature recognition
     vector<TrainingSample> trainingSamples;
+    ClassicModel classicModel;
+    FeatureTree classicTree;
+    EmbeddingGallery embeddingGallery;
+    // per label prototypes, compared against instead of every sample when enabled
+    bool usePrototypes = false;
+    int prototypesPerLabel = 3;
+    ClassicModel classicPrototypes;
+    FeatureTree classicPrototypeTree;
+    EmbeddingGallery embeddingPrototypes;
     string trainingFilename = "C:\\Users\\Nihal Sandadi\\Desktop\\training_data.json";
+    string galleryIndexFilename = trainingFilename.substr(0, trainingFilename.find_last_of('.')) + ".hnsw";
     double classificationThreshold = 2.0;
+    // cascade: the CNN only runs when the classic result is Unknown or its margin over the next label is small
+    bool useCascade = false;
+    double cascadeMargin = 0.5;
+    int cascadeCandidates = 3;
+    // bumped whenever a sample is added or the search mode changes so cached CNN results get reclassified
+    int trainingRevision = 0;
+    RegionTracker tracker;
+    // region image and network input tensor for embedding training samples
+    cv::Mat embeddingImage;
+    EmbeddingTensor embeddingTensor;
+    // classification embeddings are computed on worker threads, against the gallery of serviceRevision
+    unique_ptr<EmbeddingService> embeddingService;
+    int serviceRevision = -1;
+    vector<EmbeddingResult> embeddingResults;
     // this is for the cnn
     cv::dnn::Net cnnNet;
     std::string modelPath = "C:\\Users\\Nihal Sandadi\\Desktop\\computer vision\\hw3\\ObjectRecognition\\ObjectRecognition\\resnet18-v2-7.onnx";
@@ -72,12 +142,29 @@ int main() {
             cout << "CNN model file found: " << modelPath << endl;
             cnnNet = cv::dnn::readNetFromONNX(modelPath);
             cout << "CNN model loaded successfully!" << endl;
+            embeddingService.reset(new EmbeddingService(modelPath));
+            cout << "CNN embedding workers: " << embeddingService->workers() << endl;
+            cout << "Embedding distance kernels: " << distanceKernelName() << endl;
         }
     }
     catch (const std::exception& e) {
         cout << "Error loading CNN model: " << e.what() << endl;
     }
 
+    // training data saved by an earlier run, and the gallery's HNSW index with it if it still matches
+    if (loadTrainingData(trainingSamples, trainingFilename)) {
+        buildClassicModel(classicModel, trainingSamples);
+        buildFeatureTree(classicTree, classicModel);
+        embeddingGallery.searchMode = GALLERY_EXACT;
+        buildEmbeddingGallery(embeddingGallery, trainingSamples);
+        if (loadGalleryIndex(embeddingGallery, galleryIndexFilename)) {
+            cout << "Gallery index loaded from " << galleryIndexFilename << endl;
+        }
+        else {
+            cout << "Gallery index rebuilt for " << embeddingGallery.labels.size() << " embeddings" << endl;
+        }
+    }
+
     namedWindow("Original Video", WINDOW_AUTOSIZE);
     namedWindow("Thresholded Video", WINDOW_AUTOSIZE);
     namedWindow("Cleaned Video", WINDOW_AUTOSIZE);
@@ -92,95 +179,189 @@ int main() {
         }
 
         if (mode == 0) {
-            thresholded = grayscaleThreshold(frame);
+            grayscaleThreshold(frame, thresholdedMask, &thresholdTracker);
+        }
+        else if (mode == 1) {
+            customThreshold(frame, thresholdedMask, &thresholdTracker);
+        }
+        else if (mode == 2) {
+            backgroundThreshold(frame, backgroundModel, thresholdedMask);
         }
         else {
-            thresholded = customThreshold(frame);
+            adaptiveTileThreshold(frame, thresholdedMask);
         }
 
         if (useMorphologicalClean) {
-            cleaned = enhancedCleanThreshold(thresholded);
+            morphology.enhancedClean(thresholdedMask, cleanedMask);
         }
         else {
-            cleaned = basicCleanThreshold(thresholded);
+            morphology.basicClean(thresholdedMask, cleanedMask);
         }
 
+        // 8-bit copies are only for the display windows
+        thresholdedMask.toMat(thresholded);
+        cleanedMask.toMat(cleaned);
+
         vector<Region> regions;
         vector<RegionFeatures> regionFeatures;
+        FrameLabeling labeling;
         if (showRegionAnalysis) {
-            regions = analyzeRegions(cleaned, minArea, maxRegions, ignoreBoundaryRegions);
-            regionMap = createRegionMap(cleaned, regions, true, true);
+            regions = analyzeRegions(cleanedMask, labeling, minArea, maxRegions, ignoreBoundaryRegions);
+            regionMap = createRegionMap(cleaned, regions, labeling, true, true);
 
             // if check on whether to show features for objects in the region
             if (showFeatures && !regions.empty()) {
                 for (const auto& region : regions) {
-                    Mat regionMask = Mat::zeros(cleaned.size(), CV_8UC1);
-                    Mat labels, stats, centroids;
-                    Mat invertedBinary;
-                    bitwise_not(cleaned, invertedBinary);
-                    connectedComponentsWithStats(invertedBinary, labels, stats, centroids, 8);
-
-                    if (region.centroid.x >= 0 && region.centroid.x < labels.cols &&
-                        region.centroid.y >= 0 && region.centroid.y < labels.rows) {
-                        int originalLabel = labels.at<int>(region.centroid.y, region.centroid.x);
-                        regionMask = (labels == originalLabel);
-                    }
+                    // mask only the bounding box so the cost follows the object size, not the frame size
+                    Mat regionMask = (labeling.labels(region.boundingBox) == region.label);
 
-                    RegionFeatures features = computeRegionFeatures(regionMask, region.id);
+                    RegionFeatures features = computeRegionFeatures(labeling.moments[region.label], regionMask, region.id,
+                        region.boundingBox.tl());
                     regionFeatures.push_back(features);
+                }
+                vector<int> regionTracks = updateTracks(tracker, regions, regionFeatures);
 
-                    drawRegionFeatures(regionMap, features, region.color);
-
-                    if (!trainingMode && !trainingSamples.empty()) {
+                // the classic result comes first, in cascade mode it decides whether the CNN is needed
+                vector<CascadeDecision> decisions(regions.size());
+                if (!trainingMode && !trainingSamples.empty()) {
+                    for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+                        const RegionFeatures& features = regionFeatures[i];
                         vector<double> currentFeatures = {
                             features.percentFilled,
                             features.aspectRatio,
                             features.elongation,
                             features.huMoments[0]
                         };
+                        const ClassicModel& model = usePrototypes ? classicPrototypes : classicModel;
+                        const FeatureTree& tree = usePrototypes ? classicPrototypeTree : classicTree;
+                        if (useCascade) {
+                            decisions[i] = classifyCascade(currentFeatures, model, tree, classificationThreshold,
+                                cascadeMargin, cascadeCandidates);
+                        }
+                        else {
+                            decisions[i].classic = classifyObject(currentFeatures, model, tree, classificationThreshold);
+                            decisions[i].needsCNN = true;
+                        }
+                    }
+                }
 
-                        ClassificationResult result = classifyObject(currentFeatures, trainingSamples, classificationThreshold);
-                        string classificationText = result.isUnknown ? "Unknown" : result.label;
-                        Scalar color = result.isUnknown ? Scalar(0, 0, 255) : Scalar(0, 255, 0);
-                        putText(regionMap, "Class: " + classificationText,
-                            Point(features.centroidX - 50, features.centroidY - 30),
-                            FONT_HERSHEY_SIMPLEX, 0.6, color, 2);
-                        putText(regionMap, "Dist: " + to_string(result.distance).substr(0, 5),
-                            Point(features.centroidX - 50, features.centroidY - 60),
-                            FONT_HERSHEY_SIMPLEX, 0.5, color, 1);
+                // the network only runs when a track's cached embedding is out of date, and does so on the
+                // service's workers; tracks whose result predates the training set are rematched here in one batch
+                if (!trainingMode && !trainingSamples.empty() && embeddingService) {
+                    if (serviceRevision != trainingRevision) {
+                        embeddingService->setGallery(usePrototypes ? embeddingPrototypes : embeddingGallery, trainingRevision);
+                        serviceRevision = trainingRevision;
+                    }
 
-                        if (!cnnNet.empty()) {
+                    // queue the regions needing a new embedding, the workers pick them up without holding up this loop
+                    for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+                        const RegionFeatures& features = regionFeatures[i];
+                        Track& track = tracker.tracks[regionTracks[i]];
+                        if (decisions[i].needsCNN && needsEmbedding(tracker, track) && embeddingService->hasCapacity()) {
                             try {
-                                cv::Mat embeddingImage;
-                                prepEmbeddingImage(frame, embeddingImage,
+                                EmbeddingJob job;
+                                job.image = embeddingService->acquireImage();
+                                job.trackId = track.id;
+                                job.box = features.orientedBoundingBox;
+                                job.candidates = decisions[i].candidates;
+                                prepEmbeddingInput(frame, job.image,
                                     features.centroidX, features.centroidY,
                                     features.orientedBoundingBox.angle * CV_PI / 180.0,
                                     -features.orientedBoundingBox.size.width / 2, features.orientedBoundingBox.size.width / 2,
-                                    -features.orientedBoundingBox.size.height / 2, features.orientedBoundingBox.size.height / 2,
-                                    0);
+                                    -features.orientedBoundingBox.size.height / 2, features.orientedBoundingBox.size.height / 2);
+                                track.embeddingPending = embeddingService->submit(std::move(job));
+                            }
+                            catch (const std::exception& e) {
+                            }
+                        }
+                    }
 
-                                cv::Mat embedding;
-                                getEmbedding(embeddingImage, embedding, cnnNet, 0);
+                    // attach whatever finished since the last frame to the tracks that are still around, swapping
+                    // the embeddings in; the tracks' old buffers go back to the service with the results
+                    embeddingService->collectResults(embeddingResults);
+                    for (EmbeddingResult& finished : embeddingResults) {
+                        for (Track& track : tracker.tracks) {
+                            if (track.id != finished.trackId) {
+                                continue;
+                            }
+                            track.embeddingPending = false;
+                            if (!finished.embedding.empty()) {
+                                storeEmbedding(track, finished.embedding, finished.box);
+                                if (finished.revision >= 0) {
+                                    track.cnnResult = finished.result;
+                                    track.classifiedRevision = finished.revision;
+                                    track.cnnCandidates.swap(finished.candidates);
+                                }
+                            }
+                            break;
+                        }
+                    }
 
-                                std::vector<float> cnnEmbedding;
-                                cnnEmbedding.assign((float*)embedding.datastart, (float*)embedding.dataend);
+                    // a cached result is reused while both the training revision and the candidate labels match;
+                    // restricted ones only scan the candidates' rows, the rest are rematched in one batch
+                    vector<Track*> unclassified;
+                    for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+                        Track& track = tracker.tracks[regionTracks[i]];
+                        if (!decisions[i].needsCNN || !track.hasEmbedding ||
+                            (track.classifiedRevision == trainingRevision && track.cnnCandidates == decisions[i].candidates)) {
+                            continue;
+                        }
+                        if (!decisions[i].candidates.empty()) {
+                            track.cnnResult = classifyObjectCNN(track.embedding,
+                                usePrototypes ? embeddingPrototypes : embeddingGallery, decisions[i].candidates, 100000.0f);
+                            track.classifiedRevision = trainingRevision;
+                            track.cnnCandidates = decisions[i].candidates;
+                        }
+                        else {
+                            unclassified.push_back(&track);
+                        }
+                    }
 
-                                ClassificationResult cnnResult = classifyObjectCNN(cnnEmbedding, trainingSamples, 100000.0f);
+                    if (!unclassified.empty()) {
+                        int embeddingLength = static_cast<int>(unclassified[0]->embedding.size());
+                        Mat queries(static_cast<int>(unclassified.size()), embeddingLength, CV_32F);
+                        for (int q = 0; q < static_cast<int>(unclassified.size()); q++) {
+                            std::copy(unclassified[q]->embedding.begin(), unclassified[q]->embedding.end(), queries.ptr<float>(q));
+                        }
+                        vector<ClassificationResult> cnnResults = classifyObjectsCNN(queries,
+                            usePrototypes ? embeddingPrototypes : embeddingGallery, 100000.0f);
+                        for (int q = 0; q < static_cast<int>(unclassified.size()); q++) {
+                            unclassified[q]->cnnResult = cnnResults[q];
+                            unclassified[q]->classifiedRevision = trainingRevision;
+                            unclassified[q]->cnnCandidates.clear();
+                        }
+                    }
+                }
 
-                                std::string cnnClassificationText = cnnResult.isUnknown ? "CNN: Unknown" : "CNN: " + cnnResult.label;
-                                cv::Scalar cnnColor = cnnResult.isUnknown ? cv::Scalar(0, 0, 255) : cv::Scalar(255, 255, 0);
+                for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+                    const RegionFeatures& features = regionFeatures[i];
+                    Track& track = tracker.tracks[regionTracks[i]];
 
-                                putText(regionMap, cnnClassificationText,
-                                    Point(features.centroidX - 50, features.centroidY + 30),
-                                    FONT_HERSHEY_SIMPLEX, 0.6, cnnColor, 2);
+                    drawRegionFeatures(regionMap, features, regions[i].color);
 
-                                putText(regionMap, "CNN Dist: " + std::to_string(cnnResult.distance).substr(0, 8),
-                                    Point(features.centroidX - 50, features.centroidY + 60),
-                                    FONT_HERSHEY_SIMPLEX, 0.5, cnnColor, 1);
+                    if (!trainingMode && !trainingSamples.empty()) {
+                        const ClassificationResult& result = decisions[i].classic;
+                        string classificationText = result.isUnknown ? "Unknown" : result.label;
+                        Scalar color = result.isUnknown ? Scalar(0, 0, 255) : Scalar(0, 255, 0);
+                        putText(regionMap, "Class: " + classificationText,
+                            Point(features.centroidX - 50, features.centroidY - 30),
+                            FONT_HERSHEY_SIMPLEX, 0.6, color, 2);
+                        putText(regionMap, "Dist: " + to_string(result.distance).substr(0, 5),
+                            Point(features.centroidX - 50, features.centroidY - 60),
+                            FONT_HERSHEY_SIMPLEX, 0.5, color, 1);
 
-                            }
-                            catch (const std::exception& e) {
-                            }
+                        if (!cnnNet.empty() && track.hasEmbedding && decisions[i].needsCNN) {
+                            const ClassificationResult& cnnResult = track.cnnResult;
+                            std::string cnnClassificationText = cnnResult.isUnknown ? "CNN: Unknown" : "CNN: " + cnnResult.label;
+                            cv::Scalar cnnColor = cnnResult.isUnknown ? cv::Scalar(0, 0, 255) : cv::Scalar(255, 255, 0);
+
+                            putText(regionMap, cnnClassificationText,
+                                Point(features.centroidX - 50, features.centroidY + 30),
+                                FONT_HERSHEY_SIMPLEX, 0.6, cnnColor, 2);
+
+                            putText(regionMap, "CNN Dist: " + std::to_string(cnnResult.distance).substr(0, 8),
+                                Point(features.centroidX - 50, features.centroidY + 60),
+                                FONT_HERSHEY_SIMPLEX, 0.5, cnnColor, 1);
                         }
                     }
                 }
@@ -188,6 +369,8 @@ int main() {
                 featureDisplay = createFeatureDisplay(regionFeatures, Size(400, 300));
             }
             else {
+                // nothing is observed this frame, so existing tracks age out
+                updateTracks(tracker, {}, {});
                 cvtColor(cleaned, regionMap, COLOR_GRAY2BGR);
                 featureDisplay = Mat::zeros(Size(400, 300), CV_8UC3);
                 putText(featureDisplay, "Feature display disabled", Point(50, 150),
@@ -195,13 +378,20 @@ int main() {
             }
         }
         else {
+            // as with the feature display off, tracks age out rather than wait to be matched to whatever shows up next
+            updateTracks(tracker, {}, {});
             cvtColor(cleaned, regionMap, COLOR_GRAY2BGR);
             featureDisplay = Mat::zeros(Size(400, 300), CV_8UC3);
             putText(featureDisplay, "Region analysis disabled", Point(50, 150),
                 FONT_HERSHEY_SIMPLEX, 0.6, Scalar(255, 255, 255), 1);
         }
 
-        string modeText = (mode == 0) ? "Grayscale" : "Custom";
+        string modeText = (mode == 0) ? "Grayscale" : (mode == 1) ? "Custom" :
+            (mode == 2) ? "Background" : "Adaptive";
+        if (mode == 2 && !isBackgroundLearned(backgroundModel)) {
+            modeText += " (learning " + to_string(backgroundModel.framesLearned) + "/" +
+                to_string(backgroundModel.learningFrames) + ")";
+        }
         string cleanText = useMorphologicalClean ? "Morph Clean" : "Basic Clean";
         string regionText = showRegionAnalysis ? "ON" : "OFF";
         string featureText = showFeatures ? "ON" : "OFF";
@@ -230,7 +420,7 @@ int main() {
             displayTrainingStatus(frame, trainingSamples, waitingForLabelInput);
         }
 
-        string instructions = "g/c: Modes | m: Cleaning | r: Regions | f: Features | t: Training | +/-: Area | q: Quit";
+        string instructions = "g/c/b/a: Modes | e: CNN Search | p: Prototypes | k: Cascade | m: Cleaning | r: Regions | f: Features | t: Training | +/-: Area | q: Quit";
         if (trainingMode) {
             instructions += " | n: Save Object | s: Save Data";
         }
@@ -250,12 +440,59 @@ int main() {
         }
         else if (key == 'g' || key == 'G') {
             mode = 0;
+            thresholdTracker = ThresholdTracker();
             cout << "Switched to grayscale thresholding" << endl;
         }
         else if (key == 'c' || key == 'C') {
             mode = 1;
+            thresholdTracker = ThresholdTracker();
             cout << "Switched to custom thresholding" << endl;
         }
+        else if (key == 'b' || key == 'B') {
+            mode = 2;
+            resetBackgroundModel(backgroundModel);
+            cout << "Switched to background model thresholding, learning background..." << endl;
+        }
+        else if (key == 'a' || key == 'A') {
+            mode = 3;
+            cout << "Switched to adaptive tiled thresholding" << endl;
+        }
+        else if (key == 'e' || key == 'E') {
+            // cycles exact, HNSW, pruned, FP16, INT8 and PQ
+            GallerySearchMode nextMode = static_cast<GallerySearchMode>((embeddingGallery.searchMode + 1) % (GALLERY_PQ + 1));
+            QuantizationReport report = {};
+            {
+                unique_lock<shared_mutex> galleryLock = lockGalleries(embeddingService.get());
+                // a quantized gallery may have dropped its FP32 rows, the next mode needs them back
+                if (galleryRowsReleased(embeddingGallery)) {
+                    embeddingGallery.searchMode = GALLERY_EXACT;
+                    buildEmbeddingGallery(embeddingGallery, trainingSamples);
+                }
+                setGallerySearchMode(embeddingGallery, nextMode, &report);
+            }
+            trainingRevision++;
+            cout << "CNN gallery search: " << gallerySearchModeName(nextMode) << endl;
+            if (nextMode >= GALLERY_FP16) {
+                cout << "  " << report.bytes << " bytes in place of the FP32 rows (" << report.scanReduction
+                    << "x smaller), top-1 agreement "
+                    << report.topOneAgreement * 100.0 << "%, mean distance error " << report.meanDistanceError * 100.0 << "%" << endl;
+            }
+        }
+        else if (key == 'p' || key == 'P') {
+            usePrototypes = !usePrototypes;
+            trainingRevision++;
+            cout << "Prototype classification: " << (usePrototypes ? "ENABLED" : "DISABLED (all samples)") << endl;
+            if (usePrototypes) {
+                unique_lock<shared_mutex> galleryLock = lockGalleries(embeddingService.get());
+                rebuildPrototypes(classicModel, embeddingGallery, prototypesPerLabel, classicPrototypes, classicPrototypeTree,
+                    embeddingPrototypes);
+            }
+        }
+        else if (key == 'k' || key == 'K') {
+            useCascade = !useCascade;
+            cout << "Cascade classification: " << (useCascade ? "ENABLED (CNN only when the classic margin is under "
+                + to_string(cascadeMargin).substr(0, 4) + ")" : "DISABLED (CNN on every region)") << endl;
+        }
         else if (key == 'm' || key == 'M') {
             useMorphologicalClean = !useMorphologicalClean;
             cout << "Morphological cleaning: " << (useMorphologicalClean ? "ENABLED" : "DISABLED") << endl;
@@ -300,19 +537,18 @@ int main() {
                         try {
                             cv::RotatedRect obb = regionFeatures[0].orientedBoundingBox;
 
-                            cv::Mat embeddingImage;
-                            prepEmbeddingImage(frame, embeddingImage,
+                            prepEmbeddingInput(frame, embeddingImage,
                                 regionFeatures[0].centroidX, regionFeatures[0].centroidY,
                                 obb.angle * CV_PI / 180.0,
                                 -obb.size.width / 2, obb.size.width / 2,
-                                -obb.size.height / 2, obb.size.height / 2,
-                                0);
+                                -obb.size.height / 2, obb.size.height / 2);
 
-                            cv::Mat embedding;
-                            getEmbedding(embeddingImage, embedding, cnnNet, 0);
+                            beginEmbeddingBatch(embeddingTensor, 1);
+                            fillEmbeddingInput(embeddingTensor, 0, embeddingImage);
+                            const cv::Mat& embedding = runEmbeddingBatch(embeddingTensor, cnnNet);
 
-                            sample.cnnEmbedding.assign((float*)embedding.datastart,
-                                (float*)embedding.dataend);
+                            sample.cnnEmbedding.assign(embedding.ptr<float>(0),
+                                embedding.ptr<float>(0) + embedding.cols);
 
                             cout << "CNN embedding captured! Size: " << sample.cnnEmbedding.size() << endl;
 
@@ -323,6 +559,17 @@ int main() {
                     }
 
                     trainingSamples.push_back(sample);
+                    addToClassicModel(classicModel, sample);
+                    syncFeatureTree(classicTree, classicModel);
+                    {
+                        unique_lock<shared_mutex> galleryLock = lockGalleries(embeddingService.get());
+                        addToEmbeddingGallery(embeddingGallery, sample);
+                        if (usePrototypes) {
+                            rebuildPrototypes(classicModel, embeddingGallery, prototypesPerLabel, classicPrototypes,
+                                classicPrototypeTree, embeddingPrototypes);
+                        }
+                    }
+                    trainingRevision++;
                     cout << "Saved training sample for '" << label << "'" << endl;
 
                     if (!sample.cnnEmbedding.empty()) {
@@ -348,6 +595,9 @@ int main() {
             if (saveTrainingData(trainingSamples, trainingFilename)) {
                 cout << "Training data saved successfully!" << endl;
             }
+            if (saveGalleryIndex(embeddingGallery, galleryIndexFilename)) {
+                cout << "Gallery index saved to " << galleryIndexFilename << endl;
+            }
         }
     }
 
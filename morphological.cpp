@@ -7,25 +7,546 @@
 
 #include "morphological.h"
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstring>
 
 using namespace cv;
 using namespace std;
 
+/*
+  Max and min with the value that leaves the other operand unchanged, which
+  is also what OpenCV assumes outside the image for dilate and erode.
+*/
+struct MaxOp {
+    static uchar neutral() { return 0; }
+    uchar operator()(uchar a, uchar b) const { return a > b ? a : b; }
+};
+
+struct MinOp {
+    static uchar neutral() { return 255; }
+    uchar operator()(uchar a, uchar b) const { return a < b ? a : b; }
+};
+
+/*
+  shape : structuring element shape (MORPH_ELLIPSE, MORPH_RECT, ...)
+  size : structuring element size
+  dilate : true for dilation, false for erosion
+
+  Decomposes the structuring element OpenCV would build into rectangles: for
+  every distinct row run, the rows whose run covers it. A dilation by the
+  element is then the max of separable rectangle dilations.
+*/
+static MorphologyEngine::Operation makeOperation(int shape, Size size, bool dilate) {
+    Mat element = getStructuringElement(shape, size);
+    Point anchor(size.width / 2, size.height / 2);
+
+    vector<int> runStart(size.height, 0), runEnd(size.height, 0);
+    for (int i = 0; i < size.height; i++) {
+        const uchar* row = element.ptr<uchar>(i);
+        int j = 0;
+        while (j < size.width && !row[j]) j++;
+        runStart[i] = j;
+        while (j < size.width && row[j]) j++;
+        runEnd[i] = j;
+    }
+
+    MorphologyEngine::Operation op;
+    op.dilate = dilate;
+    for (int i = 0; i < size.height; i++) {
+        if (runStart[i] == runEnd[i]) continue;
+        int top = i, bottom = i;
+        while (top > 0 && runStart[top - 1] <= runStart[i] && runEnd[top - 1] >= runEnd[i]) top--;
+        while (bottom < size.height - 1 && runStart[bottom + 1] <= runStart[i] && runEnd[bottom + 1] >= runEnd[i]) bottom++;
+
+        MorphologyEngine::Span span = { runStart[i] - anchor.x, runEnd[i] - 1 - anchor.x,
+            top - anchor.y, bottom - anchor.y };
+        bool covered = false;
+        for (const auto& other : op.spans) {
+            if (other.dxStart <= span.dxStart && other.dxEnd >= span.dxEnd &&
+                other.dyStart <= span.dyStart && other.dyEnd >= span.dyEnd) {
+                covered = true;
+                break;
+            }
+        }
+        if (!covered) {
+            op.spans.push_back(span);
+        }
+    }
+
+    op.dyMin = 0;
+    op.dyMax = 0;
+    for (const auto& span : op.spans) {
+        op.dyMin = min(op.dyMin, span.dyStart);
+        op.dyMax = max(op.dyMax, span.dyEnd);
+    }
+    return op;
+}
+
+/*
+  line : input with cols + window - 1 values
+  out : output row, out[x] is the max/min of line[x .. x + window - 1]
+  g, h : scratch of cols + window - 1 values
+
+  van Herk / Gil-Werman running max/min: prefix and suffix maxima within
+  blocks of the window size give any window in one more op, so the cost is
+  3 ops per pixel whatever the window. Windows up to 3 are done directly.
+*/
+template <class Op>
+static void windowRow(const uchar* line, uchar* out, int cols, int window, uchar* g, uchar* h) {
+    Op op;
+    if (window == 1) {
+        memcpy(out, line, cols);
+        return;
+    }
+    if (window == 2) {
+        for (int x = 0; x < cols; x++) out[x] = op(line[x], line[x + 1]);
+        return;
+    }
+    if (window == 3) {
+        for (int x = 0; x < cols; x++) out[x] = op(op(line[x], line[x + 1]), line[x + 2]);
+        return;
+    }
+
+    int length = cols + window - 1;
+    for (int i = 0; i < length; i++) {
+        g[i] = (i % window == 0) ? line[i] : op(g[i - 1], line[i]);
+    }
+    for (int i = length - 1; i >= 0; i--) {
+        h[i] = (i % window == window - 1 || i == length - 1) ? line[i] : op(h[i + 1], line[i]);
+    }
+    for (int x = 0; x < cols; x++) {
+        out[x] = op(h[x], g[x + window - 1]);
+    }
+}
+
+/*
+  in : count + window - 1 input row pointers
+  out : count output row pointers, out[j] is the max/min of rows in[j .. j + window - 1]
+  accumulate : combine into out instead of overwriting it
+  g, h : scratch of (count + window - 1) * cols values
+
+  Same running max/min as windowRow but down the columns, on whole rows at a
+  time so every step is a vectorizable row operation.
+*/
+template <class Op>
+static void windowColumns(const uchar* const* in, uchar* const* out, int count, int cols, int window,
+    bool accumulate, uchar* g, uchar* h) {
+    Op op;
+    auto emit = [&](uchar* dst, int x, uchar v) {
+        dst[x] = accumulate ? op(dst[x], v) : v;
+    };
+
+    if (window <= 3) {
+        for (int j = 0; j < count; j++) {
+            uchar* dst = out[j];
+            const uchar* r0 = in[j];
+            const uchar* r1 = window > 1 ? in[j + 1] : r0;
+            const uchar* r2 = window > 2 ? in[j + 2] : r1;
+            for (int x = 0; x < cols; x++) {
+                emit(dst, x, op(op(r0[x], r1[x]), r2[x]));
+            }
+        }
+        return;
+    }
+
+    int length = count + window - 1;
+    for (int i = 0; i < length; i++) {
+        uchar* gi = g + static_cast<size_t>(i) * cols;
+        if (i % window == 0) {
+            memcpy(gi, in[i], cols);
+        }
+        else {
+            const uchar* prev = gi - cols;
+            for (int x = 0; x < cols; x++) gi[x] = op(prev[x], in[i][x]);
+        }
+    }
+    for (int i = length - 1; i >= 0; i--) {
+        uchar* hi = h + static_cast<size_t>(i) * cols;
+        if (i % window == window - 1 || i == length - 1) {
+            memcpy(hi, in[i], cols);
+        }
+        else {
+            const uchar* next = hi + cols;
+            for (int x = 0; x < cols; x++) hi[x] = op(next[x], in[i][x]);
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        const uchar* hj = h + static_cast<size_t>(j) * cols;
+        const uchar* gj = g + static_cast<size_t>(j + window - 1) * cols;
+        uchar* dst = out[j];
+        for (int x = 0; x < cols; x++) {
+            emit(dst, x, op(hj[x], gj[x]));
+        }
+    }
+}
+
+/*
+  op : dilation or erosion to apply
+  input : returns the input row pointer for image row r (inside the image)
+  output : returns the output row pointer for image row r
+  outStart, outEnd : output rows to produce
+  rows, cols : image size
+  s : band scratch
+
+  Applies one operation to a range of rows: for every rectangle a horizontal
+  running max/min of each input row it needs, then a vertical one combined
+  into the output rows. Rows outside the image read as the neutral value.
+*/
+template <class Op, class InputRow, class OutputRow>
+static void applyOperation(const MorphologyEngine::Operation& op, InputRow input, OutputRow output,
+    int outStart, int outEnd, int rows, int cols, MorphologyEngine::BandScratch& s) {
+    int count = outEnd - outStart;
+    if (count <= 0) return;
+    const uchar* neutralRow = (Op::neutral() == 0) ? s.neutralLow.data() : s.neutralHigh.data();
+
+    s.outputPointers.resize(count);
+    for (int j = 0; j < count; j++) {
+        s.outputPointers[j] = output(outStart + j);
+    }
+
+    bool accumulate = false;
+    for (const auto& span : op.spans) {
+        int windowX = span.dxEnd - span.dxStart + 1;
+        int windowY = span.dyEnd - span.dyStart + 1;
+        int length = count + windowY - 1;
+        s.rowPointers.resize(length);
+
+        for (int i = 0; i < length; i++) {
+            int r = outStart + span.dyStart + i;
+            if (r < 0 || r >= rows) {
+                s.rowPointers[i] = neutralRow;
+                continue;
+            }
+
+            const uchar* src = input(r);
+            uchar* line = s.line.data();
+            int lineLength = cols + windowX - 1;
+            for (int k = 0; k < lineLength; k++) {
+                int x = k + span.dxStart;
+                line[k] = (x >= 0 && x < cols) ? src[x] : Op::neutral();
+            }
+            uchar* dst = s.horizontal.data() + static_cast<size_t>(i) * cols;
+            windowRow<Op>(line, dst, cols, windowX, s.lineG.data(), s.lineH.data());
+            s.rowPointers[i] = dst;
+        }
+
+        windowColumns<Op>(s.rowPointers.data(), s.outputPointers.data(), count, cols, windowY, accumulate,
+            s.columnG.data(), s.columnH.data());
+        accumulate = true;
+    }
+}
+
+/*
+  Builds the three cleaning sequences from the same structuring elements the
+  original dilate/erode/morphologyEx calls used.
+*/
+MorphologyEngine::MorphologyEngine() {
+    Operation erodeSmall = makeOperation(MORPH_ELLIPSE, Size(3, 3), false);
+    Operation dilateSmall = makeOperation(MORPH_ELLIPSE, Size(3, 3), true);
+    Operation dilate8 = makeOperation(MORPH_ELLIPSE, Size(8, 8), true);
+    Operation erode4 = makeOperation(MORPH_ELLIPSE, Size(4, 4), false);
+
+    // open then close with the 3x3 ellipse
+    basicSequence = { erodeSmall, dilateSmall, dilateSmall, erodeSmall };
+    cleanSequence = { dilate8, erode4 };
+    enhancedSequence = basicSequence;
+    enhancedSequence.insert(enhancedSequence.end(), cleanSequence.begin(), cleanSequence.end());
+}
+
+/*
+  ops : sequence of dilations/erosions to apply in order
+  src : binary input image
+  dst : output image, may be the same as src
+
+  Fused execution of an operation sequence. The image is split into row bands
+  processed in parallel. Each band works out how many extra rows every stage
+  needs from the stage before, runs the whole sequence on its rows in band
+  sized scratch buffers and writes only the final rows, so the full image is
+  read and written once no matter how many operations there are.
+*/
+void MorphologyEngine::run(const vector<Operation>& ops, const Mat& src, Mat& dst) {
+    CV_Assert(src.type() == CV_8UC1);
+    const Mat* input = &src;
+    if (src.data == dst.data) {
+        src.copyTo(inPlaceCopy);
+        input = &inPlaceCopy;
+    }
+    dst.create(src.size(), CV_8UC1);
+    if (ops.empty()) {
+        input->copyTo(dst);
+        return;
+    }
+
+    int rows = src.rows, cols = src.cols;
+    int n = static_cast<int>(ops.size());
+    int bands = max(1, min(getNumThreads(), rows / 32));
+    if (static_cast<int>(scratch.size()) < bands) {
+        scratch.resize(bands);
+    }
+
+    int haloTop = 0, haloBottom = 0, maxWindowX = 1, maxWindowY = 1;
+    for (const auto& op : ops) {
+        haloTop -= op.dyMin;
+        haloBottom += op.dyMax;
+        for (const auto& span : op.spans) {
+            maxWindowX = max(maxWindowX, span.dxEnd - span.dxStart + 1);
+            maxWindowY = max(maxWindowY, span.dyEnd - span.dyStart + 1);
+        }
+    }
+    int maxBandRows = (rows + bands - 1) / bands + haloTop + haloBottom;
+    size_t stageSize = static_cast<size_t>(maxBandRows) * cols;
+    size_t columnSize = static_cast<size_t>(maxBandRows + maxWindowY) * cols;
+    for (int band = 0; band < bands; band++) {
+        BandScratch& s = scratch[band];
+        s.stageA.resize(stageSize);
+        s.stageB.resize(stageSize);
+        s.horizontal.resize(columnSize);
+        s.columnG.resize(columnSize);
+        s.columnH.resize(columnSize);
+        s.line.resize(cols + maxWindowX);
+        s.lineG.resize(cols + maxWindowX);
+        s.lineH.resize(cols + maxWindowX);
+        s.neutralLow.assign(cols, MaxOp::neutral());
+        s.neutralHigh.assign(cols, MinOp::neutral());
+    }
+
+    const Mat& in = *input;
+    parallel_for_(Range(0, bands), [&](const Range& bandRange) {
+        for (int band = bandRange.start; band < bandRange.end; band++) {
+            BandScratch& s = scratch[band];
+
+            // rows each stage has to produce, working back from the band
+            int stageStart[16], stageEnd[16];
+            CV_Assert(n < 16);
+            stageStart[n] = rows * band / bands;
+            stageEnd[n] = rows * (band + 1) / bands;
+            for (int k = n; k > 0; k--) {
+                stageStart[k - 1] = max(0, stageStart[k] + ops[k - 1].dyMin);
+                stageEnd[k - 1] = min(rows, stageEnd[k] + ops[k - 1].dyMax);
+            }
+
+            uchar* stageBuffers[2] = { s.stageA.data(), s.stageB.data() };
+            for (int k = 0; k < n; k++) {
+                const uchar* inBase = stageBuffers[k % 2];
+                uchar* outBase = stageBuffers[(k + 1) % 2];
+                int inStart = stageStart[k];
+                int outStart = stageStart[k + 1];
+
+                auto inputRow = [&](int r) -> const uchar* {
+                    return k == 0 ? in.ptr<uchar>(r) : inBase + static_cast<size_t>(r - inStart) * cols;
+                };
+                auto outputRow = [&](int r) -> uchar* {
+                    return k == n - 1 ? dst.ptr<uchar>(r) : outBase + static_cast<size_t>(r - outStart) * cols;
+                };
+
+                if (ops[k].dilate) {
+                    applyOperation<MaxOp>(ops[k], inputRow, outputRow, stageStart[k + 1], stageEnd[k + 1], rows, cols, s);
+                }
+                else {
+                    applyOperation<MinOp>(ops[k], inputRow, outputRow, stageStart[k + 1], stageEnd[k + 1], rows, cols, s);
+                }
+            }
+        }
+    });
+}
+
+/*
+  src : one packed row
+  dst : output packed row, bit x is bit x + shift of src (0 outside the row)
+  nWords : words per row
+  shift : pixel offset, negative to shift towards higher columns
+
+  Shifts a whole packed row by any number of pixels across word boundaries.
+*/
+static void shiftRowBits(const uint64_t* src, uint64_t* dst, int nWords, int shift) {
+    int wordShift = abs(shift) >> 6;
+    int bitShift = abs(shift) & 63;
+    for (int w = 0; w < nWords; w++) {
+        uint64_t near, far;
+        if (shift >= 0) {
+            int s = w + wordShift;
+            near = s < nWords ? src[s] : 0;
+            far = s + 1 < nWords ? src[s + 1] : 0;
+            dst[w] = bitShift ? (near >> bitShift) | (far << (64 - bitShift)) : near;
+        }
+        else {
+            int s = w - wordShift;
+            near = s >= 0 ? src[s] : 0;
+            far = s - 1 >= 0 ? src[s - 1] : 0;
+            dst[w] = bitShift ? (near << bitShift) | (far >> (64 - bitShift)) : near;
+        }
+    }
+}
+
+/*
+  acc : packed row, replaced by its running OR
+  shifted : scratch row
+  nWords : words per row
+  length : window length in pixels
+  direction : 1 to OR in the pixels to the right, -1 for the ones to the left
+
+  Makes bit x the OR of bits x .. x + direction * (length - 1), doubling the
+  covered width every step so a window of W pixels takes log2(W) steps.
+  Offsets are always taken from x itself, so nothing that lands inside the
+  row is shifted out and lost on the way.
+*/
+static void runningOr(uint64_t* acc, uint64_t* shifted, int nWords, int length, int direction) {
+    int covered = 1;
+    while (covered < length) {
+        int step = min(covered, length - covered);
+        shiftRowBits(acc, shifted, nWords, direction * step);
+        for (int w = 0; w < nWords; w++) acc[w] |= shifted[w];
+        covered += step;
+    }
+}
+
+/*
+  op : dilation to apply (the erosion sequence steps are complemented around it)
+  src : packed input mask
+  dst : packed output mask
+
+  Word-parallel dilation by a union of rectangles. Each row is ORed with
+  shifted copies of itself to cover the rectangle's columns, then the rows
+  in its height are ORed together.
+*/
+void MorphologyEngine::dilateMask(const Operation& op, const BinaryMask& src, BinaryMask& dst) {
+    int rows = src.rows(), nWords = src.wordsPerRow();
+    uint64_t tail = src.tailMask();
+    dst.create(rows, src.cols());
+    dst.setAll(false);
+    maskHorizontal.create(rows, src.cols());
+    rowAccumulator.resize(nWords);
+    rowShifted.resize(nWords);
+    uint64_t* acc = rowAccumulator.data();
+    uint64_t* shifted = rowShifted.data();
+
+    for (const auto& span : op.spans) {
+        for (int y = 0; y < rows; y++) {
+            const uint64_t* in = src.row(y);
+            uint64_t* out = maskHorizontal.row(y);
+
+            if (span.dxStart >= 0) {
+                for (int w = 0; w < nWords; w++) acc[w] = in[w];
+                runningOr(acc, shifted, nWords, span.dxEnd - span.dxStart + 1, 1);
+                shiftRowBits(acc, out, nWords, span.dxStart);
+            }
+            else if (span.dxEnd <= 0) {
+                for (int w = 0; w < nWords; w++) acc[w] = in[w];
+                runningOr(acc, shifted, nWords, span.dxEnd - span.dxStart + 1, -1);
+                shiftRowBits(acc, out, nWords, span.dxEnd);
+            }
+            else {
+                // window straddles the pixel itself: left part and right part separately
+                for (int w = 0; w < nWords; w++) acc[w] = in[w];
+                runningOr(acc, shifted, nWords, span.dxEnd + 1, 1);
+                for (int w = 0; w < nWords; w++) out[w] = acc[w];
+                for (int w = 0; w < nWords; w++) acc[w] = in[w];
+                runningOr(acc, shifted, nWords, 1 - span.dxStart, -1);
+                for (int w = 0; w < nWords; w++) out[w] |= acc[w];
+            }
+            out[nWords - 1] &= tail;
+        }
+
+        for (int y = 0; y < rows; y++) {
+            uint64_t* out = dst.row(y);
+            int r0 = max(0, y + span.dyStart), r1 = min(rows - 1, y + span.dyEnd);
+            for (int r = r0; r <= r1; r++) {
+                const uint64_t* h = maskHorizontal.row(r);
+                for (int w = 0; w < nWords; w++) out[w] |= h[w];
+            }
+        }
+    }
+}
+
+/*
+  ops : sequence of dilations/erosions to apply in order
+  src : packed binary input
+  dst : packed output, may be the same as src
+
+  Packed version of the cleaning sequence. A 640x480 mask is under 40KB so
+  every stage stays in cache and runs over whole rows of words. Erosions
+  use the complement: erode(x) = not dilate(not x), with the same neutral
+  border as OpenCV.
+*/
+void MorphologyEngine::run(const vector<Operation>& ops, const BinaryMask& src, BinaryMask& dst) {
+    const BinaryMask* current = &src;
+    BinaryMask* stages[2] = { &maskStageA, &maskStageB };
+    for (size_t k = 0; k < ops.size(); k++) {
+        BinaryMask* next = stages[k % 2];
+        if (ops[k].dilate) {
+            dilateMask(ops[k], *current, *next);
+        }
+        else {
+            current->invert(maskComplement);
+            dilateMask(ops[k], maskComplement, *next);
+            next->invert(*next);
+        }
+        current = next;
+    }
+
+    if (current != &dst) {
+        dst = *current;
+    }
+}
+
 /*
   thresholded : binary image from thresholding operation
+  cleaned : output cleaned image
 
-  Applies morphological dilation (8x8) followed by erosion (4x4),
-  better for curved objects, like real world applications
+  Dilation (8x8 ellipse) followed by erosion (4x4 ellipse).
 */
-Mat morphologicalClean(const Mat& thresholded) {
-    Mat cleaned = thresholded.clone();
+void MorphologyEngine::morphologicalClean(const Mat& thresholded, Mat& cleaned) {
+    run(cleanSequence, thresholded, cleaned);
+}
+
+/*
+  thresholded : binary image from thresholding operation
+  cleaned : output cleaned image
+
+  3x3 opening and closing followed by the dilation/erosion of morphologicalClean.
+*/
+void MorphologyEngine::enhancedClean(const Mat& thresholded, Mat& cleaned) {
+    run(enhancedSequence, thresholded, cleaned);
+}
+
+/*
+  thresholded : binary image from thresholding operation
+  cleaned : output cleaned image
+
+  3x3 opening and closing only.
+*/
+void MorphologyEngine::basicClean(const Mat& thresholded, Mat& cleaned) {
+    run(basicSequence, thresholded, cleaned);
+}
+
+/*
+  thresholded : packed binary image from thresholding operation
+  cleaned : packed output mask
+
+  Packed versions of the three cleaning sequences above.
+*/
+void MorphologyEngine::morphologicalClean(const BinaryMask& thresholded, BinaryMask& cleaned) {
+    run(cleanSequence, thresholded, cleaned);
+}
+
+void MorphologyEngine::enhancedClean(const BinaryMask& thresholded, BinaryMask& cleaned) {
+    run(enhancedSequence, thresholded, cleaned);
+}
 
-    Mat kernel_dilate_8 = getStructuringElement(MORPH_ELLIPSE, Size(8, 8));
-    Mat kernel_erode_4 = getStructuringElement(MORPH_ELLIPSE, Size(4, 4));
+void MorphologyEngine::basicClean(const BinaryMask& thresholded, BinaryMask& cleaned) {
+    run(basicSequence, thresholded, cleaned);
+}
 
-    dilate(cleaned, cleaned, kernel_dilate_8);
-    erode(cleaned, cleaned, kernel_erode_4);
+/*
+  thresholded : binary image from thresholding operation
 
+  Applies morphological dilation (8x8) followed by erosion (4x4),
+  better for curved objects, like real world applications
+*/
+Mat morphologicalClean(const Mat& thresholded) {
+    MorphologyEngine engine;
+    Mat cleaned;
+    engine.morphologicalClean(thresholded, cleaned);
     return cleaned;
 }
 
@@ -35,14 +556,9 @@ Mat morphologicalClean(const Mat& thresholded) {
   Applies morphological dilation/erosion, this is good for more noisy images
 */
 Mat enhancedCleanThreshold(const Mat& thresholded) {
-    Mat cleaned = thresholded.clone();
-
-    Mat kernel_small = getStructuringElement(MORPH_ELLIPSE, Size(3, 3));
-    morphologyEx(cleaned, cleaned, MORPH_OPEN, kernel_small);
-    morphologyEx(cleaned, cleaned, MORPH_CLOSE, kernel_small);
-
-    cleaned = morphologicalClean(cleaned);
-
+    MorphologyEngine engine;
+    Mat cleaned;
+    engine.enhancedClean(thresholded, cleaned);
     return cleaned;
 }
 
@@ -52,11 +568,8 @@ Mat enhancedCleanThreshold(const Mat& thresholded) {
   Applies minimal morphological opening and closing with small element.
 */
 Mat basicCleanThreshold(const Mat& thresholded) {
-    Mat cleaned = thresholded.clone();
-
-    Mat kernel = getStructuringElement(MORPH_ELLIPSE, Size(3, 3));
-    morphologyEx(cleaned, cleaned, MORPH_OPEN, kernel);
-    morphologyEx(cleaned, cleaned, MORPH_CLOSE, kernel);
-
+    MorphologyEngine engine;
+    Mat cleaned;
+    engine.basicClean(thresholded, cleaned);
     return cleaned;
-}
\ No newline at end of file
+}
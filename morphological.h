@@ -9,9 +9,72 @@
 #define MORPHOLOGICAL_H
 
 #include <opencv2/opencv.hpp>
+#include <vector>
+#include <cstdint>
+#include "binaryMask.h"
+
+/*
+  Runs the cleaning sequences as one fused pass over the image. Structuring
+  elements are decomposed into rectangles once at construction, and the
+  per-band scratch rows are kept between calls, so steady state cleaning
+  does not allocate. Bit-packed masks go through the same sequences with
+  64 pixels per word operation.
+*/
+class MorphologyEngine {
+public:
+    MorphologyEngine();
+    void morphologicalClean(const cv::Mat& thresholded, cv::Mat& cleaned);
+    void enhancedClean(const cv::Mat& thresholded, cv::Mat& cleaned);
+    void basicClean(const cv::Mat& thresholded, cv::Mat& cleaned);
+    void morphologicalClean(const BinaryMask& thresholded, BinaryMask& cleaned);
+    void enhancedClean(const BinaryMask& thresholded, BinaryMask& cleaned);
+    void basicClean(const BinaryMask& thresholded, BinaryMask& cleaned);
+
+    /*
+      Rectangle of the structuring element as inclusive offsets from the anchor.
+    */
+    struct Span {
+        int dxStart, dxEnd;
+        int dyStart, dyEnd;
+    };
+
+    /*
+      One dilation (max) or erosion (min) by a union of rectangles.
+    */
+    struct Operation {
+        bool dilate;
+        std::vector<Span> spans;
+        int dyMin, dyMax;
+    };
+
+    /*
+      Rows and line buffers one band of rows works in.
+    */
+    struct BandScratch {
+        std::vector<uchar> stageA, stageB;
+        std::vector<uchar> horizontal, columnG, columnH;
+        std::vector<uchar> line, lineG, lineH;
+        std::vector<uchar> neutralLow, neutralHigh;
+        std::vector<const uchar*> rowPointers;
+        std::vector<uchar*> outputPointers;
+    };
+
+private:
+    void run(const std::vector<Operation>& ops, const cv::Mat& src, cv::Mat& dst);
+    void run(const std::vector<Operation>& ops, const BinaryMask& src, BinaryMask& dst);
+    void dilateMask(const Operation& op, const BinaryMask& src, BinaryMask& dst);
+
+    std::vector<Operation> cleanSequence;
+    std::vector<Operation> basicSequence;
+    std::vector<Operation> enhancedSequence;
+    std::vector<BandScratch> scratch;
+    cv::Mat inPlaceCopy;
+    BinaryMask maskStageA, maskStageB, maskHorizontal, maskComplement;
+    std::vector<uint64_t> rowAccumulator, rowShifted;
+};
 
 cv::Mat morphologicalClean(const cv::Mat& thresholded);
 cv::Mat enhancedCleanThreshold(const cv::Mat& thresholded);
 cv::Mat basicCleanThreshold(const cv::Mat& thresholded);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,175 @@
+/*
+  Nihal Sandadi
+
+  Implementation of prototype classification. Each label's samples are
+  clustered with k-means and the cluster centers become that label's
+  prototypes, for both the classic features and the CNN embeddings.
+*/
+
+#include "prototypes.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+/*
+  rows : CV_32F samples, one per row
+  labels : label of each row
+  perLabel : most prototypes to keep per label
+  centers : output, CV_32F prototypes, one per row
+  centerLabels : output, label of each prototype
+
+  Groups the rows by label and replaces each group with up to perLabel
+  k-means centers. A label with no more samples than that keeps its samples
+  as they are, and one prototype per label is simply the mean.
+*/
+static void clusterByLabel(const Mat& rows, const vector<string>& labels, int perLabel,
+    Mat& centers, vector<string>& centerLabels) {
+
+    centers.release();
+    centerLabels.clear();
+    map<string, vector<int>> labelRows;
+    for (int i = 0; i < rows.rows; i++) {
+        labelRows[labels[i]].push_back(i);
+    }
+
+    perLabel = max(1, perLabel);
+    for (const auto& group : labelRows) {
+        Mat samples;
+        for (int i : group.second) {
+            samples.push_back(rows.row(i));
+        }
+
+        Mat groupCenters;
+        if (samples.rows <= perLabel) {
+            groupCenters = samples;
+        }
+        else if (perLabel == 1) {
+            cv::reduce(samples, groupCenters, 0, REDUCE_AVG);
+        }
+        else {
+            Mat assignments;
+            kmeans(samples, perLabel, assignments, TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 50, 1e-5),
+                3, KMEANS_PP_CENTERS, groupCenters);
+        }
+
+        centers.push_back(groupCenters);
+        centerLabels.insert(centerLabels.end(), groupCenters.rows, group.first);
+    }
+}
+
+/*
+  model : classic model compiled from the full training set
+  perLabel : most prototypes to keep per label
+  prototypes : output, a model with the same statistics whose rows are the prototypes
+
+  Clusters the scaled feature rows per label. The prototypes keep the full
+  set's means and spreads, so classifyObject scales the query the same way
+  and only compares it with a few rows per label.
+*/
+void buildClassicPrototypes(const ClassicModel& model, int perLabel, ClassicModel& prototypes) {
+    const int n = ClassicModel::featureCount;
+    prototypes = model;
+    prototypes.rawFeatures.clear();
+    prototypes.scaledFeatures.clear();
+    prototypes.labels.clear();
+    prototypes.labelIds.clear();
+    if (model.labels.empty()) {
+        return;
+    }
+
+    Mat scaled;
+    Mat(static_cast<int>(model.labels.size()), n, CV_64F, const_cast<double*>(model.scaledFeatures.data()))
+        .convertTo(scaled, CV_32F);
+
+    Mat centers;
+    clusterByLabel(scaled, model.labels, perLabel, centers, prototypes.labels);
+    for (const string& label : prototypes.labels) {
+        prototypes.labelIds.push_back(static_cast<int>(
+            find(model.labelNames.begin(), model.labelNames.end(), label) - model.labelNames.begin()));
+    }
+    for (int p = 0; p < centers.rows; p++) {
+        const float* center = centers.ptr<float>(p);
+        for (int i = 0; i < n; i++) {
+            prototypes.scaledFeatures.push_back(center[i]);
+            prototypes.rawFeatures.push_back(center[i] / model.scale[i]);
+        }
+    }
+}
+
+/*
+  gallery : CNN gallery of the full training set
+  perLabel : most prototypes to keep per label
+  prototypes : output, gallery of the prototypes
+
+  Clusters the embeddings per label into a new gallery, from the quantized
+  rows widened back if the gallery has released its full precision ones.
+  The prototype gallery is always scanned exactly, it is small enough that
+  an index wouldn't pay for itself.
+*/
+void buildEmbeddingPrototypes(const EmbeddingGallery& gallery, int perLabel, EmbeddingGallery& prototypes) {
+    vector<TrainingSample> samples;
+    Mat embeddings;
+    galleryEmbeddings(gallery, embeddings);
+    if (!embeddings.empty()) {
+        Mat centers;
+        vector<string> centerLabels;
+        clusterByLabel(embeddings, gallery.labels, perLabel, centers, centerLabels);
+        samples.resize(centers.rows);
+        for (int p = 0; p < centers.rows; p++) {
+            samples[p].label = centerLabels[p];
+            samples[p].cnnEmbedding.assign(centers.ptr<float>(p), centers.ptr<float>(p) + centers.cols);
+        }
+    }
+
+    prototypes.searchMode = GALLERY_EXACT;
+    buildEmbeddingGallery(prototypes, samples);
+}
+
+/*
+  model : classic model of the full training set
+  prototypes : prototypes built from it
+
+  Fraction of the training samples whose nearest prototype carries their own
+  label, how much of the training set accuracy the prototypes keep.
+*/
+double classicPrototypeAgreement(const ClassicModel& model, const ClassicModel& prototypes) {
+    const int n = ClassicModel::featureCount;
+    if (model.labels.empty()) {
+        return 1.0;
+    }
+
+    int agreements = 0;
+    for (int s = 0; s < static_cast<int>(model.labels.size()); s++) {
+        vector<double> features(model.rawFeatures.begin() + s * n, model.rawFeatures.begin() + (s + 1) * n);
+        ClassificationResult result = classifyObject(features, prototypes, numeric_limits<double>::max());
+        agreements += (result.label == model.labels[s]);
+    }
+    return static_cast<double>(agreements) / model.labels.size();
+}
+
+/*
+  gallery : CNN gallery of the full training set
+  prototypes : prototypes built from it
+
+  Same as above for the CNN embeddings.
+*/
+double embeddingPrototypeAgreement(const EmbeddingGallery& gallery, const EmbeddingGallery& prototypes) {
+    Mat embeddings;
+    galleryEmbeddings(gallery, embeddings);
+    if (embeddings.empty()) {
+        return 1.0;
+    }
+
+    vector<ClassificationResult> results = classifyObjectsCNN(embeddings, prototypes,
+        numeric_limits<float>::max());
+    int agreements = 0;
+    for (int s = 0; s < static_cast<int>(results.size()); s++) {
+        agreements += (results[s].label == gallery.labels[s]);
+    }
+    return static_cast<double>(agreements) / results.size();
+}
@@ -0,0 +1,21 @@
+/*
+  Nihal Sandadi
+
+  Header file for prototype classification, condensing the training set into
+  a few representative points per label so classification cost follows the
+  number of objects rather than the number of samples.
+*/
+
+#ifndef PROTOTYPES_H
+#define PROTOTYPES_H
+
+#include <vector>
+#include "classification.h"
+#include "embeddingGallery.h"
+
+void buildClassicPrototypes(const ClassicModel& model, int perLabel, ClassicModel& prototypes);
+void buildEmbeddingPrototypes(const EmbeddingGallery& gallery, int perLabel, EmbeddingGallery& prototypes);
+double classicPrototypeAgreement(const ClassicModel& model, const ClassicModel& prototypes);
+double embeddingPrototypeAgreement(const EmbeddingGallery& gallery, const EmbeddingGallery& prototypes);
+
+#endif
@@ -0,0 +1,442 @@
+/*
+  Nihal Sandadi
+
+  Implementation of the quantized embedding galleries: fitting the ranges or
+  codebooks, encoding rows and the asymmetric distance scans, where the
+  query stays in full precision and only the gallery is compressed.
+*/
+
+#include "quantizedGallery.h"
+#include "distanceKernels.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+// centroids per product quantization subspace, so each code fits in a byte
+static const int pqCentroids = 256;
+// ranges and codebooks fitted on fewer rows than this are refitted as rows arrive
+static const int minFittedRows = 256;
+// at most this many rows are used to fit the INT8 ranges, spread evenly over the gallery
+static const int maxFittingRows = 20000;
+// and this many for the PQ codebooks, 16 per centroid is plenty for 8 float subspaces
+static const int maxPqFittingRows = 16 * pqCentroids;
+// k-means iterations per PQ subspace
+static const int pqIterations = 10;
+
+/*
+  dim : embedding length
+
+  Floats per product quantization subspace, the largest of 8, 4, 2 or 1 that
+  divides the embedding length.
+*/
+static int pqSubspaceDim(int dim) {
+    for (int size = 8; size > 1; size /= 2) {
+        if (dim % size == 0) {
+            return size;
+        }
+    }
+    return 1;
+}
+
+/*
+  gallery : gallery whose ranges or codebooks to fit, storage and dim set
+  embeddings : full precision rows
+
+  Fits the INT8 per dimension ranges on up to maxFittingRows of the rows, or
+  the PQ codebooks on up to maxPqFittingRows. The PQ k-means runs, one per
+  subspace, are independent and run in parallel with a small iteration
+  count, which keeps the fit well under a second even for a large gallery.
+  FP16 needs no fitting.
+*/
+static void fitQuantizer(QuantizedGallery& gallery, const Mat& embeddings) {
+    gallery.trainedRows = embeddings.rows;
+    if (gallery.storage == QUANTIZED_FP16) {
+        return;
+    }
+
+    int fittingRows = (gallery.storage == QUANTIZED_PQ) ? maxPqFittingRows : maxFittingRows;
+    Mat fitting;
+    if (embeddings.rows <= fittingRows) {
+        fitting = embeddings;
+    }
+    else {
+        double step = static_cast<double>(embeddings.rows) / fittingRows;
+        for (int i = 0; i < fittingRows; i++) {
+            fitting.push_back(embeddings.row(static_cast<int>(i * step)));
+        }
+    }
+
+    if (gallery.storage == QUANTIZED_INT8) {
+        gallery.offsets.assign(gallery.dim, 0.0f);
+        gallery.scales.assign(gallery.dim, 1.0f);
+        for (int d = 0; d < gallery.dim; d++) {
+            double low, high;
+            minMaxIdx(fitting.col(d), &low, &high);
+            gallery.offsets[d] = static_cast<float>(low);
+            gallery.scales[d] = (high > low) ? static_cast<float>((high - low) / 255.0) : 1.0f;
+        }
+        return;
+    }
+
+    gallery.subspaceDim = pqSubspaceDim(gallery.dim);
+    gallery.subspaces = gallery.dim / gallery.subspaceDim;
+    gallery.centroidCount = min(pqCentroids, fitting.rows);
+    gallery.codebooks.resize(static_cast<size_t>(gallery.subspaces) * gallery.centroidCount * gallery.subspaceDim);
+    parallel_for_(Range(0, gallery.subspaces), [&](const Range& range) {
+        for (int s = range.start; s < range.end; s++) {
+            Mat block = fitting.colRange(s * gallery.subspaceDim, (s + 1) * gallery.subspaceDim).clone();
+            Mat labels, centers;
+            kmeans(block, gallery.centroidCount, labels,
+                TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, pqIterations, 1e-4), 1, KMEANS_PP_CENTERS, centers);
+            float* codebook = &gallery.codebooks[static_cast<size_t>(s) * gallery.centroidCount * gallery.subspaceDim];
+            for (int c = 0; c < gallery.centroidCount; c++) {
+                copy(centers.ptr<float>(c), centers.ptr<float>(c) + gallery.subspaceDim, codebook + c * gallery.subspaceDim);
+            }
+        }
+    });
+}
+
+/*
+  gallery : gallery to append to, already fitted
+  row : full precision embedding of dim floats
+
+  Encodes one row in the gallery's format and appends it, with the ranges
+  or codebooks as they are. Used on its own once the gallery is settled and
+  the full precision rows are gone.
+*/
+void appendQuantizedRow(QuantizedGallery& gallery, const float* row) {
+    const int dim = gallery.dim;
+    if (gallery.storage == QUANTIZED_FP16) {
+        size_t start = gallery.halfValues.size();
+        gallery.halfValues.resize(start + dim);
+        Mat half(1, dim, CV_16F, &gallery.halfValues[start]);
+        Mat(1, dim, CV_32F, const_cast<float*>(row)).convertTo(half, CV_16F);
+    }
+    else if (gallery.storage == QUANTIZED_INT8) {
+        for (int d = 0; d < dim; d++) {
+            gallery.codes.push_back(saturate_cast<uchar>((row[d] - gallery.offsets[d]) / gallery.scales[d]));
+        }
+    }
+    else {
+        for (int s = 0; s < gallery.subspaces; s++) {
+            const float* part = row + s * gallery.subspaceDim;
+            const float* codebook = &gallery.codebooks[static_cast<size_t>(s) * gallery.centroidCount * gallery.subspaceDim];
+            int best = 0;
+            float bestDistance = numeric_limits<float>::max();
+            for (int c = 0; c < gallery.centroidCount; c++) {
+                float d = squaredL2Distance(part, codebook + c * gallery.subspaceDim, gallery.subspaceDim);
+                if (d < bestDistance) {
+                    bestDistance = d;
+                    best = c;
+                }
+            }
+            gallery.codes.push_back(static_cast<uint8_t>(best));
+        }
+    }
+    gallery.count++;
+}
+
+/*
+  gallery : gallery to fill
+  storage : format to store the rows in
+  embeddings : full precision rows, one CV_32F embedding per row
+
+  Fits the format to the rows and encodes all of them, replacing what the
+  gallery held.
+*/
+void buildQuantizedGallery(QuantizedGallery& gallery, QuantizedStorage storage, const Mat& embeddings) {
+    gallery = QuantizedGallery();
+    gallery.storage = storage;
+    if (embeddings.empty()) {
+        return;
+    }
+
+    gallery.dim = embeddings.cols;
+    fitQuantizer(gallery, embeddings);
+    for (int row = 0; row < embeddings.rows; row++) {
+        appendQuantizedRow(gallery, embeddings.ptr<float>(row));
+    }
+}
+
+/*
+  gallery : gallery to bring up to date
+  embeddings : full precision rows, the gallery's rows followed by new ones
+
+  Encodes the rows added since the last call. While the ranges or codebooks
+  were fitted on only a few rows they are refitted from everything instead,
+  since the first handful of samples says little about the rest.
+*/
+void syncQuantizedGallery(QuantizedGallery& gallery, const Mat& embeddings) {
+    bool refit = gallery.storage != QUANTIZED_FP16 && gallery.trainedRows < minFittedRows &&
+        embeddings.rows > gallery.trainedRows;
+    if (refit || embeddings.rows < gallery.count || (gallery.count > 0 && embeddings.cols != gallery.dim)) {
+        buildQuantizedGallery(gallery, gallery.storage, embeddings);
+        return;
+    }
+
+    if (gallery.count == 0 && !embeddings.empty()) {
+        gallery.dim = embeddings.cols;
+        fitQuantizer(gallery, embeddings);
+    }
+    for (int row = gallery.count; row < embeddings.rows; row++) {
+        appendQuantizedRow(gallery, embeddings.ptr<float>(row));
+    }
+}
+
+/*
+  gallery : quantized gallery
+
+  Whether the format no longer needs the full precision rows: FP16 needs no
+  fitting, and INT8 and PQ stop refitting once fitted on minFittedRows.
+*/
+bool quantizedGallerySettled(const QuantizedGallery& gallery) {
+    return gallery.count > 0 && (gallery.storage == QUANTIZED_FP16 || gallery.trainedRows >= minFittedRows);
+}
+
+/*
+  gallery : quantized gallery
+  embeddings : output, count x dim CV_32F rows
+
+  Widens the rows back to full precision, each as close to the original as
+  the format allows: the half precision values, the 8 bit levels or the PQ
+  centroids.
+*/
+void decodeQuantizedGallery(const QuantizedGallery& gallery, Mat& embeddings) {
+    embeddings.create(gallery.count, gallery.dim, CV_32F);
+    if (gallery.count == 0) {
+        return;
+    }
+
+    if (gallery.storage == QUANTIZED_FP16) {
+        Mat(gallery.count, gallery.dim, CV_16F, const_cast<uint16_t*>(gallery.halfValues.data())).convertTo(embeddings, CV_32F);
+        return;
+    }
+    for (int row = 0; row < gallery.count; row++) {
+        float* decoded = embeddings.ptr<float>(row);
+        if (gallery.storage == QUANTIZED_INT8) {
+            const uint8_t* code = &gallery.codes[static_cast<size_t>(row) * gallery.dim];
+            for (int d = 0; d < gallery.dim; d++) {
+                decoded[d] = gallery.offsets[d] + code[d] * gallery.scales[d];
+            }
+            continue;
+        }
+        const uint8_t* code = &gallery.codes[static_cast<size_t>(row) * gallery.subspaces];
+        for (int s = 0; s < gallery.subspaces; s++) {
+            const float* centroid = &gallery.codebooks[(static_cast<size_t>(s) * gallery.centroidCount + code[s]) *
+                gallery.subspaceDim];
+            copy(centroid, centroid + gallery.subspaceDim, decoded + s * gallery.subspaceDim);
+        }
+    }
+}
+
+/*
+  gallery : quantized gallery
+
+  Bytes taken by the encoded rows plus the ranges or codebooks.
+*/
+size_t quantizedGalleryBytes(const QuantizedGallery& gallery) {
+    return gallery.halfValues.size() * sizeof(uint16_t) + gallery.codes.size() +
+        (gallery.offsets.size() + gallery.scales.size() + gallery.codebooks.size()) * sizeof(float);
+}
+
+/*
+  gallery : quantized gallery
+  query : full precision query of dim floats
+  distances : output, squared distance from the query to every row
+
+  The asymmetric scan. FP16 and INT8 widen each row on the fly in the
+  distance kernels; PQ first tabulates the distance from each query
+  subvector to every centroid, after which a row's distance is one table
+  lookup per subspace.
+*/
+static void quantizedDistances(const QuantizedGallery& gallery, const float* query, vector<float>& distances) {
+    const int dim = gallery.dim;
+    distances.resize(gallery.count);
+
+    if (gallery.storage == QUANTIZED_FP16) {
+        for (int row = 0; row < gallery.count; row++) {
+            distances[row] = squaredL2DistanceHalf(query, &gallery.halfValues[static_cast<size_t>(row) * dim], dim);
+        }
+    }
+    else if (gallery.storage == QUANTIZED_INT8) {
+        thread_local vector<float> shifted;
+        shifted.resize(dim);
+        for (int d = 0; d < dim; d++) {
+            shifted[d] = query[d] - gallery.offsets[d];
+        }
+        for (int row = 0; row < gallery.count; row++) {
+            distances[row] = squaredL2DistanceScaled(shifted.data(), &gallery.codes[static_cast<size_t>(row) * dim],
+                gallery.scales.data(), dim);
+        }
+    }
+    else {
+        const int centroids = gallery.centroidCount;
+        thread_local vector<float> table;
+        table.resize(static_cast<size_t>(gallery.subspaces) * centroids);
+        for (int s = 0; s < gallery.subspaces; s++) {
+            const float* part = query + s * gallery.subspaceDim;
+            const float* codebook = &gallery.codebooks[static_cast<size_t>(s) * centroids * gallery.subspaceDim];
+            for (int c = 0; c < centroids; c++) {
+                table[s * centroids + c] = squaredL2Distance(part, codebook + c * gallery.subspaceDim, gallery.subspaceDim);
+            }
+        }
+        for (int row = 0; row < gallery.count; row++) {
+            const uint8_t* code = &gallery.codes[static_cast<size_t>(row) * gallery.subspaces];
+            const float* subspaceTable = table.data();
+            float sum = 0;
+            for (int s = 0; s < gallery.subspaces; s++, subspaceTable += centroids) {
+                sum += subspaceTable[code[s]];
+            }
+            distances[row] = sum;
+        }
+    }
+}
+
+/*
+  gallery : quantized gallery
+  query : full precision query of dim floats
+  k : number of neighbours wanted
+  nearest : output, up to k (squared distance, row) pairs nearest first
+
+  Finds the k rows nearest the query by their quantized distances.
+*/
+void searchQuantizedGallery(const QuantizedGallery& gallery, const float* query, int k,
+    vector<pair<float, int>>& nearest) {
+    nearest.clear();
+    if (gallery.count == 0 || k <= 0) {
+        return;
+    }
+
+    thread_local vector<float> distances;
+    quantizedDistances(gallery, query, distances);
+    nearest.resize(gallery.count);
+    for (int row = 0; row < gallery.count; row++) {
+        nearest[row] = { distances[row], row };
+    }
+    int kept = min(k, gallery.count);
+    partial_sort(nearest.begin(), nearest.begin() + kept, nearest.end());
+    nearest.resize(kept);
+}
+
+/*
+  gallery : quantized gallery
+  query : full precision query of dim floats
+  row : gallery row
+
+  Asymmetric squared distance from the query to a single row, for scans
+  over a few chosen rows rather than the whole gallery.
+*/
+float quantizedDistance(const QuantizedGallery& gallery, const float* query, int row) {
+    const int dim = gallery.dim;
+    if (gallery.storage == QUANTIZED_FP16) {
+        return squaredL2DistanceHalf(query, &gallery.halfValues[static_cast<size_t>(row) * dim], dim);
+    }
+    if (gallery.storage == QUANTIZED_INT8) {
+        thread_local vector<float> shifted;
+        shifted.resize(dim);
+        for (int d = 0; d < dim; d++) {
+            shifted[d] = query[d] - gallery.offsets[d];
+        }
+        return squaredL2DistanceScaled(shifted.data(), &gallery.codes[static_cast<size_t>(row) * dim],
+            gallery.scales.data(), dim);
+    }
+
+    const uint8_t* code = &gallery.codes[static_cast<size_t>(row) * gallery.subspaces];
+    float sum = 0;
+    for (int s = 0; s < gallery.subspaces; s++) {
+        const float* centroid = &gallery.codebooks[(static_cast<size_t>(s) * gallery.centroidCount + code[s]) *
+            gallery.subspaceDim];
+        sum += squaredL2Distance(query + s * gallery.subspaceDim, centroid, gallery.subspaceDim);
+    }
+    return sum;
+}
+
+/*
+  gallery : quantized gallery built from embeddings
+  embeddings : the full precision rows
+  maxQueries : how many rows to use as queries
+
+  Measures what the format costs in accuracy. Rows spread evenly over the
+  gallery are used as queries against all the other rows, and the nearest
+  neighbour and its distance are compared between the exact full precision
+  scan and the quantized one. The queries run in parallel.
+*/
+QuantizationReport measureQuantization(const QuantizedGallery& gallery, const Mat& embeddings, int maxQueries) {
+    QuantizationReport report;
+    report.bytes = quantizedGalleryBytes(gallery);
+    report.scanReduction = (report.bytes > 0) ?
+        static_cast<double>(embeddings.total()) * sizeof(float) / report.bytes : 1.0;
+    report.topOneAgreement = 1.0;
+    report.meanDistanceError = 0.0;
+    if (gallery.count != embeddings.rows || embeddings.rows < 2 || maxQueries <= 0) {
+        return report;
+    }
+
+    int queryCount = min(maxQueries, embeddings.rows);
+    double step = static_cast<double>(embeddings.rows) / queryCount;
+    vector<int> agreed(queryCount, 0);
+    vector<double> errors(queryCount, -1.0);
+
+    parallel_for_(Range(0, queryCount), [&](const Range& range) {
+        vector<float> approximate;
+        for (int q = range.start; q < range.end; q++) {
+            int queryRow = static_cast<int>(q * step);
+            const float* query = embeddings.ptr<float>(queryRow);
+
+            int exactBest = -1;
+            float exactDistance = numeric_limits<float>::max();
+            for (int row = 0; row < embeddings.rows; row++) {
+                if (row == queryRow) continue;
+                float d = squaredL2Distance(query, embeddings.ptr<float>(row), embeddings.cols);
+                if (d < exactDistance) {
+                    exactDistance = d;
+                    exactBest = row;
+                }
+            }
+
+            quantizedDistances(gallery, query, approximate);
+            int approximateBest = -1;
+            float approximateDistance = numeric_limits<float>::max();
+            for (int row = 0; row < gallery.count; row++) {
+                if (row != queryRow && approximate[row] < approximateDistance) {
+                    approximateDistance = approximate[row];
+                    approximateBest = row;
+                }
+            }
+
+            agreed[q] = (approximateBest == exactBest);
+            if (exactDistance > 0) {
+                errors[q] = fabs(sqrt(approximate[exactBest]) - sqrt(exactDistance)) / sqrt(exactDistance);
+            }
+        }
+    });
+
+    int agreements = 0;
+    int measured = 0;
+    double errorSum = 0.0;
+    for (int q = 0; q < queryCount; q++) {
+        agreements += agreed[q];
+        if (errors[q] >= 0) {
+            errorSum += errors[q];
+            measured++;
+        }
+    }
+
+    report.topOneAgreement = static_cast<double>(agreements) / queryCount;
+    report.meanDistanceError = (measured > 0) ? errorSum / measured : 0.0;
+    return report;
+}
+
+/*
+  storage : quantized format
+
+  Short name of the format for messages.
+*/
+const char* quantizedStorageName(QuantizedStorage storage) {
+    static const char* names[] = { "FP16", "INT8", "PQ" };
+    return names[storage];
+}
@@ -0,0 +1,81 @@
+/*
+  Nihal Sandadi
+
+  Header file for compressed CNN embedding galleries: half precision, 8 bit
+  per dimension scaling and product quantization, each searched with the
+  full precision query against the compressed rows.
+*/
+
+#ifndef QUANTIZED_GALLERY_H
+#define QUANTIZED_GALLERY_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+/*
+  Storage format of a quantized gallery. QUANTIZED_FP16 halves the rows,
+  QUANTIZED_INT8 stores one byte per dimension against a per dimension range
+  (4x smaller) and QUANTIZED_PQ one byte per group of dimensions, an index
+  into a codebook learned for that group (about 30x smaller for 512 floats).
+  Once the format is settled the quantized rows replace the full precision
+  ones rather than sitting next to them, the gallery then only holds the
+  compressed rows.
+*/
+enum QuantizedStorage {
+    QUANTIZED_FP16,
+    QUANTIZED_INT8,
+    QUANTIZED_PQ
+};
+
+/*
+  Gallery rows in one quantized format. halfValues is used by FP16; codes
+  holds count x dim bytes for INT8, with offsets and scales per dimension,
+  or count x subspaces bytes for PQ, with centroidCount centroids of
+  subspaceDim floats per subspace in codebooks. trainedRows is how many rows
+  the ranges or codebooks were fitted on.
+*/
+struct QuantizedGallery {
+    QuantizedStorage storage = QUANTIZED_FP16;
+    int count = 0;
+    int dim = 0;
+    int trainedRows = 0;
+    std::vector<uint16_t> halfValues;
+    std::vector<uint8_t> codes;
+    std::vector<float> offsets;
+    std::vector<float> scales;
+    int subspaces = 0;
+    int subspaceDim = 0;
+    int centroidCount = 0;
+    std::vector<float> codebooks;
+};
+
+/*
+  How a quantized gallery compares with the full precision one: its size,
+  how many times fewer bytes a search scans than with the full precision
+  rows, the fraction of queries whose nearest neighbour is unchanged and the
+  mean relative error of the distance to the true nearest neighbour.
+  Measured against the full precision rows, so only while they are still
+  held.
+*/
+struct QuantizationReport {
+    size_t bytes;
+    double scanReduction;
+    double topOneAgreement;
+    double meanDistanceError;
+};
+
+void buildQuantizedGallery(QuantizedGallery& gallery, QuantizedStorage storage, const cv::Mat& embeddings);
+void syncQuantizedGallery(QuantizedGallery& gallery, const cv::Mat& embeddings);
+bool quantizedGallerySettled(const QuantizedGallery& gallery);
+void appendQuantizedRow(QuantizedGallery& gallery, const float* row);
+void decodeQuantizedGallery(const QuantizedGallery& gallery, cv::Mat& embeddings);
+size_t quantizedGalleryBytes(const QuantizedGallery& gallery);
+void searchQuantizedGallery(const QuantizedGallery& gallery, const float* query, int k,
+    std::vector<std::pair<float, int>>& nearest);
+float quantizedDistance(const QuantizedGallery& gallery, const float* query, int row);
+QuantizationReport measureQuantization(const QuantizedGallery& gallery, const cv::Mat& embeddings, int maxQueries = 50);
+const char* quantizedStorageName(QuantizedStorage storage);
+
+#endif
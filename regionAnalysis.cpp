@@ -16,24 +16,26 @@ using namespace cv;
 using namespace std;
 
 /*
-  binaryImage : binary image from thresholding operation
+  numLabels : number of connected component labels including background
+  stats : per label statistics in connectedComponentsWithStats layout
+  centroids : per label centroids
+  imageSize : size of the labeled image
   minArea : minimum pixel area for region consideration
   maxRegions : maximum number of regions to return
   ignoreBoundaryRegions : whether to exclude regions touching image boundaries
 
-  Analyze connected components in binary image, filters by area and boundary
-  conditions, and returns a sorted list of significant regions with properties.
+  Filters the labeled components by area and boundary conditions and returns
+  a sorted list of significant regions with properties.
 */
-vector<Region> analyzeRegions(const Mat& binaryImage,
+static vector<Region> regionsFromComponents(int numLabels,
+    const Mat& stats,
+    const Mat& centroids,
+    const Size& imageSize,
     int minArea,
     int maxRegions,
     bool ignoreBoundaryRegions) {
 
     vector<Region> regions;
-    Mat invertedBinary;
-    bitwise_not(binaryImage, invertedBinary);
-    Mat labels, stats, centroids;
-    int numLabels = connectedComponentsWithStats(invertedBinary, labels, stats, centroids, 8);
     vector<Scalar> colors;
     RNG rng(12345);
     for (int i = 0; i < numLabels; i++) {
@@ -44,6 +46,7 @@ vector<Region> analyzeRegions(const Mat& binaryImage,
     for (int i = 1; i < numLabels; i++) {
         Region region;
         region.id = i;
+        region.label = i;
         region.area = stats.at<int>(i, CC_STAT_AREA);
         region.centroid = Point(centroids.at<double>(i, 0), centroids.at<double>(i, 1));
         region.boundingBox = Rect(
@@ -63,8 +66,8 @@ vector<Region> analyzeRegions(const Mat& binaryImage,
             if (ignoreBoundaryRegions) {
                 if (region.boundingBox.x > 0 &&
                     region.boundingBox.y > 0 &&
-                    region.boundingBox.x + region.boundingBox.width < binaryImage.cols - 1 &&
-                    region.boundingBox.y + region.boundingBox.height < binaryImage.rows - 1) {
+                    region.boundingBox.x + region.boundingBox.width < imageSize.width - 1 &&
+                    region.boundingBox.y + region.boundingBox.height < imageSize.height - 1) {
                     filteredRegions.push_back(region);
                 }
             }
@@ -88,6 +91,149 @@ vector<Region> analyzeRegions(const Mat& binaryImage,
     return regions;
 }
 
+/*
+  binaryImage : binary image from thresholding operation
+  minArea : minimum pixel area for region consideration
+  maxRegions : maximum number of regions to return
+  ignoreBoundaryRegions : whether to exclude regions touching image boundaries
+
+  Analyze connected components in binary image, filters by area and boundary
+  conditions, and returns a sorted list of significant regions with properties.
+*/
+vector<Region> analyzeRegions(const Mat& binaryImage,
+    int minArea,
+    int maxRegions,
+    bool ignoreBoundaryRegions) {
+
+    Mat invertedBinary;
+    bitwise_not(binaryImage, invertedBinary);
+    Mat labels, stats, centroids;
+    int numLabels = connectedComponentsWithStats(invertedBinary, labels, stats, centroids, 8);
+    return regionsFromComponents(numLabels, stats, centroids, binaryImage.size(),
+        minArea, maxRegions, ignoreBoundaryRegions);
+}
+
+/*
+  binaryMask : packed binary image from thresholding and cleaning
+  labeling : output labeling of the frame, kept for the region map and features
+  minArea : minimum pixel area for region consideration
+  maxRegions : maximum number of regions to return
+  ignoreBoundaryRegions : whether to exclude regions touching image boundaries
+
+  Same as above, with the inversion and labeling done on the packed bits.
+  The labeling is returned so nothing downstream has to label the frame again.
+*/
+vector<Region> analyzeRegions(const BinaryMask& binaryMask,
+    FrameLabeling& labeling,
+    int minArea,
+    int maxRegions,
+    bool ignoreBoundaryRegions) {
+
+    BinaryMask inverted;
+    binaryMask.invert(inverted);
+    labeling.numLabels = labelComponents(inverted, labeling.labels, labeling.stats, labeling.centroids,
+        &labeling.moments);
+    vector<Region> regions = regionsFromComponents(labeling.numLabels, labeling.stats, labeling.centroids,
+        binaryMask.size(), minArea, maxRegions, ignoreBoundaryRegions);
+
+    labeling.labelToRegion.assign(labeling.numLabels, -1);
+    for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+        labeling.labelToRegion[regions[i].label] = i;
+    }
+    return regions;
+}
+
+/*
+  binaryMask : packed binary image from thresholding and cleaning
+  minArea : minimum pixel area for region consideration
+  maxRegions : maximum number of regions to return
+  ignoreBoundaryRegions : whether to exclude regions touching image boundaries
+
+  Same as above for callers that don't need the labeling.
+*/
+vector<Region> analyzeRegions(const BinaryMask& binaryMask,
+    int minArea,
+    int maxRegions,
+    bool ignoreBoundaryRegions) {
+
+    FrameLabeling labeling;
+    return analyzeRegions(binaryMask, labeling, minArea, maxRegions, ignoreBoundaryRegions);
+}
+
+/*
+  regions : regions with their display colors
+  labelToRegion : index into regions for each label, or -1
+
+  Packs each label's display color as B | G << 8 | R << 16 so the render
+  pass looks a pixel's color up with a single load. Labels without a region
+  stay black.
+*/
+static vector<uint32_t> regionColorTable(const vector<Region>& regions, const vector<int>& labelToRegion) {
+    vector<uint32_t> table(labelToRegion.size(), 0);
+    for (int label = 1; label < static_cast<int>(labelToRegion.size()); label++) {
+        int index = labelToRegion[label];
+        if (index >= 0 && index < static_cast<int>(regions.size())) {
+            const Scalar& color = regions[index].color;
+            table[label] = saturate_cast<uchar>(color[0]) |
+                (saturate_cast<uchar>(color[1]) << 8) |
+                (saturate_cast<uchar>(color[2]) << 16);
+        }
+    }
+    return table;
+}
+
+/*
+  colorTable : packed color per label from regionColorTable
+  labels : CV_32S label image, every label must be inside the table
+  background : optional single channel image blended half and half with the colors
+  output : CV_8UC3 result the size of labels
+
+  Colors every pixel through the table in row-parallel bands. With a
+  background the result equals addWeighted of the gray image and the color
+  map at 0.5 each; a small table of rounded halves reproduces its rounding
+  without any per pixel floating point.
+*/
+static void renderRegionColors(const vector<uint32_t>& colorTable, const Mat& labels, const Mat* background,
+    Mat& output) {
+
+    static const vector<uchar> halves = [] {
+        vector<uchar> table(511);
+        for (int sum = 0; sum < 511; sum++) {
+            table[sum] = saturate_cast<uchar>(sum * 0.5);
+        }
+        return table;
+    }();
+
+    output.create(labels.size(), CV_8UC3);
+    const uint32_t* colors = colorTable.data();
+    const uchar* half = halves.data();
+
+    parallel_for_(Range(0, labels.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const int* labelRow = labels.ptr<int>(y);
+            uchar* out = output.ptr<uchar>(y);
+            if (background == nullptr) {
+                for (int x = 0; x < labels.cols; x++) {
+                    uint32_t color = colors[labelRow[x]];
+                    out[3 * x] = static_cast<uchar>(color);
+                    out[3 * x + 1] = static_cast<uchar>(color >> 8);
+                    out[3 * x + 2] = static_cast<uchar>(color >> 16);
+                }
+            }
+            else {
+                const uchar* gray = background->ptr<uchar>(y);
+                for (int x = 0; x < labels.cols; x++) {
+                    uint32_t color = colors[labelRow[x]];
+                    int value = gray[x];
+                    out[3 * x] = half[value + (color & 0xFF)];
+                    out[3 * x + 1] = half[value + ((color >> 8) & 0xFF)];
+                    out[3 * x + 2] = half[value + ((color >> 16) & 0xFF)];
+                }
+            }
+        }
+    });
+}
+
 /*
   binaryImage : input binary image for visualization background
   regions : vector of Region objects to display
@@ -102,15 +248,45 @@ Mat createRegionMap(const Mat& binaryImage,
     bool showCentroids,
     bool showBoundingBoxes) {
 
-    Mat regionMap;
-    cvtColor(binaryImage, regionMap, COLOR_GRAY2BGR);
     Mat invertedBinary;
     bitwise_not(binaryImage, invertedBinary);
-    Mat labels, stats, centroids;
-    connectedComponentsWithStats(invertedBinary, labels, stats, centroids, 8);
-    Mat coloredMap = createColoredRegionMap(regions, labels, binaryImage.size());
+    FrameLabeling labeling;
+    labeling.numLabels = connectedComponentsWithStats(invertedBinary, labeling.labels, labeling.stats,
+        labeling.centroids, 8);
+
+    // regions from elsewhere are matched to labels through their centroids
+    labeling.labelToRegion.assign(labeling.numLabels, -1);
+    for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+        const Point& c = regions[i].centroid;
+        if (c.x >= 0 && c.x < labeling.labels.cols && c.y >= 0 && c.y < labeling.labels.rows) {
+            int label = labeling.labels.at<int>(c.y, c.x);
+            if (label > 0) {
+                labeling.labelToRegion[label] = i;
+            }
+        }
+    }
+    return createRegionMap(binaryImage, regions, labeling, showCentroids, showBoundingBoxes);
+}
+
+/*
+  binaryImage : input binary image for visualization background
+  regions : vector of Region objects to display
+  labeling : labeling of the frame the regions came from
+  showCentroids : whether to draw centroid markers and crosshairs
+  showBoundingBoxes : whether to draw bounding boxes around regions
+
+  Same as above, reusing the frame's labeling instead of labeling again.
+*/
+Mat createRegionMap(const Mat& binaryImage,
+    const vector<Region>& regions,
+    const FrameLabeling& labeling,
+    bool showCentroids,
+    bool showBoundingBoxes) {
+
+    // the half and half blend of the binary image with the region colors is
+    // done in the same pass that colors the labels
     Mat temp;
-    addWeighted(regionMap, 0.5, coloredMap, 0.5, 0, temp);
+    renderRegionColors(regionColorTable(regions, labeling.labelToRegion), labeling.labels, &binaryImage, temp);
 
     for (const auto& region : regions) {
         if (showBoundingBoxes) {
@@ -190,34 +366,45 @@ Mat createColoredRegionMap(const vector<Region>& regions,
     const Mat& labels,
     const Size& imageSize) {
 
-    Mat coloredMap = Mat::zeros(imageSize, CV_8UC3);
+    if (labels.empty()) {
+        return Mat::zeros(imageSize, CV_8UC3);
+    }
 
-    vector<int> labelToRegionId(labels.rows * labels.cols, -1);
-    for (const auto& region : regions) {
-        if (region.centroid.x >= 0 && region.centroid.x < labels.cols &&
-            region.centroid.y >= 0 && region.centroid.y < labels.rows) {
-            int originalLabel = labels.at<int>(region.centroid.y, region.centroid.x);
-            if (originalLabel > 0 && originalLabel < labelToRegionId.size()) {
-                labelToRegionId[originalLabel] = region.id;
+    // regions from elsewhere are matched to labels through their centroids
+    double maxLabel = 0;
+    minMaxIdx(labels, nullptr, &maxLabel);
+    vector<int> labelToRegion(static_cast<int>(maxLabel) + 1, -1);
+    for (int i = 0; i < static_cast<int>(regions.size()); i++) {
+        const Point& c = regions[i].centroid;
+        if (c.x >= 0 && c.x < labels.cols && c.y >= 0 && c.y < labels.rows) {
+            int label = labels.at<int>(c.y, c.x);
+            if (label > 0) {
+                labelToRegion[label] = i;
             }
         }
     }
 
-    for (int y = 0; y < labels.rows; y++) {
-        for (int x = 0; x < labels.cols; x++) {
-            int label = labels.at<int>(y, x);
-            if (label > 0 && label < labelToRegionId.size() && labelToRegionId[label] != -1) {
-                int regionIndex = labelToRegionId[label] - 1;
-                if (regionIndex >= 0 && regionIndex < regions.size()) {
-                    coloredMap.at<Vec3b>(y, x) = Vec3b(
-                        regions[regionIndex].color[0],
-                        regions[regionIndex].color[1],
-                        regions[regionIndex].color[2]
-                    );
-                }
-            }
-        }
+    Mat coloredMap;
+    renderRegionColors(regionColorTable(regions, labelToRegion), labels, nullptr, coloredMap);
+    return coloredMap;
+}
+
+/*
+  regions : vector of Region objects with color assignments
+  labeling : labeling of the frame the regions came from
+  imageSize : dimensions of the original image for output map
+
+  Same as above, coloring pixels through the labeling's label to region map.
+*/
+Mat createColoredRegionMap(const vector<Region>& regions,
+    const FrameLabeling& labeling,
+    const Size& imageSize) {
+
+    if (labeling.labels.empty()) {
+        return Mat::zeros(imageSize, CV_8UC3);
     }
 
+    Mat coloredMap;
+    renderRegionColors(regionColorTable(regions, labeling.labelToRegion), labeling.labels, nullptr, coloredMap);
     return coloredMap;
-}
\ No newline at end of file
+}
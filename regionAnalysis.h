@@ -10,6 +10,7 @@
 
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include "binaryMask.h"
 
 /*
   Stores the region properties including identification, geometric characteristics,
@@ -17,22 +18,55 @@
 */
 struct Region {
     int id;
+    int label;
     int area;
     cv::Point centroid;
     cv::Rect boundingBox;
     cv::Scalar color;
 };
 
+/*
+  Connected component labeling of one frame, computed once and shared by
+  region analysis, the region maps and feature extraction. labelToRegion
+  maps each label to its index in the returned regions, or -1. moments holds
+  each label's spatial, central and normalized moments from the same sweep.
+*/
+struct FrameLabeling {
+    int numLabels = 0;
+    cv::Mat labels;
+    cv::Mat stats;
+    cv::Mat centroids;
+    std::vector<cv::Moments> moments;
+    std::vector<int> labelToRegion;
+};
+
 std::vector<Region> analyzeRegions(const cv::Mat& binaryImage,
     int minArea = 1000,
     int maxRegions = 5,
     bool ignoreBoundaryRegions = true);
+std::vector<Region> analyzeRegions(const BinaryMask& binaryMask,
+    int minArea = 1000,
+    int maxRegions = 5,
+    bool ignoreBoundaryRegions = true);
+std::vector<Region> analyzeRegions(const BinaryMask& binaryMask,
+    FrameLabeling& labeling,
+    int minArea = 1000,
+    int maxRegions = 5,
+    bool ignoreBoundaryRegions = true);
+cv::Mat createRegionMap(const cv::Mat& binaryImage,
+    const std::vector<Region>& regions,
+    bool showCentroids = true,
+    bool showBoundingBoxes = true);
 cv::Mat createRegionMap(const cv::Mat& binaryImage,
     const std::vector<Region>& regions,
+    const FrameLabeling& labeling,
     bool showCentroids = true,
     bool showBoundingBoxes = true);
 cv::Mat createColoredRegionMap(const std::vector<Region>& regions,
     const cv::Mat& labels,
     const cv::Size& imageSize);
+cv::Mat createColoredRegionMap(const std::vector<Region>& regions,
+    const FrameLabeling& labeling,
+    const cv::Size& imageSize);
 
 #endif // REGION_ANALYSIS_H
\ No newline at end of file
@@ -24,10 +24,24 @@ using namespace std;
   for object classification and recognition.
 */
 RegionFeatures computeRegionFeatures(const Mat& regionMask, int regionId) {
+    return computeRegionFeatures(moments(regionMask, true), regionMask, regionId);
+}
+
+/*
+  m : moments of the region in frame coordinates, as accumulated during labeling
+  regionMask : binary mask of the region, only used for its outline
+  regionId : identifier for the region being processed
+  maskOffset : frame position of the mask's top-left pixel
+
+  Same as above with the moments already known, so area, centroid, Hu
+  moments and elongation don't need another scan of the mask. The mask can
+  be cropped to the region's bounding box; the outline is shifted by
+  maskOffset so the oriented box comes back in frame coordinates.
+*/
+RegionFeatures computeRegionFeatures(const Moments& m, const Mat& regionMask, int regionId, Point maskOffset) {
     RegionFeatures features;
     features.regionId = regionId;
-    features.area = countNonZero(regionMask);
-    Moments m = moments(regionMask, true);
+    features.area = m.m00;
     if (m.m00 != 0) {
         features.centroidX = m.m10 / m.m00;
         features.centroidY = m.m01 / m.m00;
@@ -35,7 +49,7 @@ RegionFeatures computeRegionFeatures(const Mat& regionMask, int regionId) {
 
     HuMoments(m, features.huMoments);
     vector<vector<Point>> contours;
-    findContours(regionMask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+    findContours(regionMask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE, maskOffset);
     if (contours.empty()) {
         return features;
     }
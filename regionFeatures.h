@@ -28,6 +28,8 @@ struct RegionFeatures {
 };
 
 RegionFeatures computeRegionFeatures(const cv::Mat& regionMask, int regionId);
+RegionFeatures computeRegionFeatures(const cv::Moments& regionMoments, const cv::Mat& regionMask, int regionId,
+    cv::Point maskOffset = cv::Point());
 void drawRegionFeatures(cv::Mat& image, const RegionFeatures& features, const cv::Scalar& color = cv::Scalar(0, 255, 255));
 cv::Mat createFeatureDisplay(const std::vector<RegionFeatures>& features, const cv::Size& size);
 
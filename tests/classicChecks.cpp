@@ -0,0 +1,195 @@
+/*
+  Nihal Sandadi
+
+  Equivalence checks for the classic classifier's KD-tree and for the
+  cascade classifier's classic stage, both against the linear scan, on
+  random training sets. Exits non zero on any mismatch.
+
+  Build from the repository root with
+    g++ -std=c++17 -O2 -I. tests/classicChecks.cpp classification.cpp featureTree.cpp
+      distanceKernels.cpp -o classicChecks `pkg-config --cflags --libs opencv4`
+*/
+
+#include "featureTree.h"
+#include <iostream>
+#include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/*
+  label : label number of the sample
+  generator : random source
+
+  A training sample for the label, with features on very different scales
+  like the real ones. The labels' features overlap, so nearby labels are
+  hard to tell apart.
+*/
+static TrainingSample randomSample(int label, mt19937& generator) {
+    normal_distribution<double> noise(0.0, 1.0);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    TrainingSample sample;
+    sample.label = "object" + to_string(label);
+    sample.features = { 0.1 + 0.05 * label + 0.02 * noise(generator), 1.0 + 0.3 * label + 0.2 * noise(generator),
+        uniform(generator), 0.001 * label + 0.0005 * noise(generator) };
+    return sample;
+}
+
+/*
+  labelCount : number of labels in the training set
+  generator : random source
+
+  Query features spread evenly over the range the labels' samples cover.
+*/
+static vector<double> randomQuery(int labelCount, mt19937& generator) {
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    return { 0.1 + 0.05 * labelCount * uniform(generator), 1.0 + 0.3 * labelCount * uniform(generator),
+        uniform(generator), 0.001 * labelCount * uniform(generator) };
+}
+
+/*
+  model : classic model to search
+  features : query features
+  k : number of nearest rows wanted
+
+  Scaled squared distances of the k nearest rows, by brute force.
+*/
+static vector<double> bruteForceNearest(const ClassicModel& model, const double* features, int k) {
+    vector<double> distances;
+    for (int row = 0; row < static_cast<int>(model.labels.size()); row++) {
+        double sum = 0.0;
+        for (int f = 0; f < ClassicModel::featureCount; f++) {
+            double d = (features[f] - model.rawFeatures[row * ClassicModel::featureCount + f]) * model.scale[f];
+            sum += d * d;
+        }
+        distances.push_back(sum);
+    }
+    sort(distances.begin(), distances.end());
+    distances.resize(min(k, static_cast<int>(distances.size())));
+    return distances;
+}
+
+/*
+  The training set is grown one sample at a time, the way training mode
+  grows it, and after each batch of samples random queries are classified
+  both by the linear scan and through the tree. The nearest k rows from the
+  tree are also compared with a brute force ranking. Returns whether
+  everything matched.
+*/
+static bool checkFeatureTree() {
+    const int sampleCount = 3000;
+    const int labelCount = 12;
+    const int k = 5;
+    mt19937 generator(19);
+
+    ClassicModel model;
+    FeatureTree tree;
+    int queries = 0;
+    int classificationMismatches = 0;
+    int nearestMismatches = 0;
+
+    for (int i = 0; i < sampleCount; i++) {
+        addToClassicModel(model, randomSample(i % labelCount, generator));
+        syncFeatureTree(tree, model);
+
+        if (i % 100 != 0) {
+            continue;
+        }
+        for (int q = 0; q < 20; q++) {
+            vector<double> features = randomQuery(labelCount, generator);
+            ClassificationResult linear = classifyObject(features, model, 2.0);
+            ClassificationResult indexed = classifyObject(features, model, tree, 2.0);
+            queries++;
+            // equal distances are ties, either label is right
+            if (linear.isUnknown != indexed.isUnknown || fabs(linear.distance - indexed.distance) > 1e-9) {
+                classificationMismatches++;
+            }
+
+            vector<pair<double, int>> nearest;
+            searchFeatureTree(tree, model, features.data(), k, nearest);
+            vector<double> expected = bruteForceNearest(model, features.data(), k);
+            if (nearest.size() != expected.size()) {
+                nearestMismatches++;
+                continue;
+            }
+            for (int n = 0; n < static_cast<int>(nearest.size()); n++) {
+                if (fabs(nearest[n].first - expected[n]) > 1e-9) {
+                    nearestMismatches++;
+                    break;
+                }
+            }
+        }
+    }
+
+    cout << "KD-tree: " << queries << " queries, " << classificationMismatches << " classification mismatches, "
+        << nearestMismatches << " nearest neighbour mismatches" << endl;
+    return classificationMismatches == 0 && nearestMismatches == 0;
+}
+
+/*
+  Random queries are classified by classifyObject and by classifyCascade,
+  both through the KD-tree and with a stale tree that forces the linear
+  scan. The cascade's classic result must match classifyObject's, the two
+  cascade paths must agree on the margin and candidates, and the best
+  candidate must be the classic label. Returns whether everything matched.
+*/
+static bool checkCascade() {
+    const int sampleCount = 600;
+    const int queryCount = 1000;
+    mt19937 generator(25);
+
+    int queries = 0;
+    int classicMismatches = 0;
+    int pathMismatches = 0;
+    int candidateErrors = 0;
+    int ambiguous = 0;
+
+    for (int labelCount : { 1, 4, 12 }) {
+        vector<TrainingSample> trainingData;
+        for (int i = 0; i < sampleCount; i++) {
+            trainingData.push_back(randomSample(i % labelCount, generator));
+        }
+
+        ClassicModel model;
+        buildClassicModel(model, trainingData);
+        FeatureTree tree;
+        buildFeatureTree(tree, model);
+        FeatureTree stale;
+
+        for (int q = 0; q < queryCount; q++) {
+            vector<double> features = randomQuery(labelCount, generator);
+            ClassificationResult classic = classifyObject(features, model, 2.0);
+            CascadeDecision indexed = classifyCascade(features, model, tree, 2.0, 0.5, 3);
+            CascadeDecision linear = classifyCascade(features, model, stale, 2.0, 0.5, 3);
+            queries++;
+            ambiguous += indexed.needsCNN;
+
+            // equal distances are ties, either label is right
+            if (classic.isUnknown != indexed.classic.isUnknown ||
+                fabs(classic.distance - indexed.classic.distance) > 1e-9) {
+                classicMismatches++;
+            }
+            if (indexed.needsCNN != linear.needsCNN || fabs(indexed.margin - linear.margin) > 1e-9 ||
+                indexed.candidates.size() != linear.candidates.size()) {
+                pathMismatches++;
+            }
+            if (indexed.needsCNN && (indexed.candidates.empty() || indexed.candidates[0] != indexed.classic.label)) {
+                candidateErrors++;
+            }
+        }
+    }
+
+    cout << "Cascade: " << queries << " queries, " << ambiguous << " passed to the CNN, " << classicMismatches
+        << " classic mismatches, " << pathMismatches << " tree and scan mismatches, " << candidateErrors
+        << " candidate errors" << endl;
+    return classicMismatches == 0 && pathMismatches == 0 && candidateErrors == 0;
+}
+
+int main() {
+    bool treeMatches = checkFeatureTree();
+    bool cascadeMatches = checkCascade();
+    return (treeMatches && cascadeMatches) ? 0 : 1;
+}
@@ -1,7 +1,7 @@
 /*
   Nihal Sandadi
 
-  an adaptive thresholding methods using k-means clustering
+  an adaptive thresholding methods using histogram based k-means clustering
   for threshold selection and multiple thresholding strategies
   for object segmentation.
 */
@@ -9,83 +9,612 @@
 #include "thresholding.h"
 #include <opencv2/opencv.hpp>
 #include <vector>
-#include <random>
+#include <mutex>
+#include <cstring>
+#include <algorithm>
 
 using namespace cv;
 using namespace std;
 
+/*
+  rows : number of image rows to split
+
+  Number of row bands to hand to parallel_for_. Bands are kept at 16 rows or
+  more so per-band setup (local histograms, blur halo rows) stays small next
+  to the band itself, with a few bands per thread for load balancing.
+*/
+static int rowBandCount(int rows) {
+    return max(1, min(rows / 16, getNumThreads() * 4));
+}
+
+/*
+  gray : single channel 8-bit image
+  histogram : output 256-bin intensity histogram
+
+  Builds the intensity histogram in one pass, each band of rows counts into
+  its own local bins in parallel and the bands are merged at the end.
+*/
+void computeHistogram(const Mat& gray, vector<int>& histogram) {
+    CV_Assert(gray.type() == CV_8UC1);
+    histogram.assign(256, 0);
+    mutex mergeLock;
+    int bands = rowBandCount(gray.rows);
+
+    parallel_for_(Range(0, bands), [&](const Range& bandRange) {
+        // 4 interleaved sub-histograms so neighbouring equal pixels don't
+        // serialize on the same counter
+        int local[4][256] = {};
+        int yStart = gray.rows * bandRange.start / bands;
+        int yEnd = gray.rows * bandRange.end / bands;
+        for (int y = yStart; y < yEnd; y++) {
+            const uchar* row = gray.ptr<uchar>(y);
+            int x = 0;
+            for (; x + 4 <= gray.cols; x += 4) {
+                local[0][row[x]]++;
+                local[1][row[x + 1]]++;
+                local[2][row[x + 2]]++;
+                local[3][row[x + 3]]++;
+            }
+            for (; x < gray.cols; x++) {
+                local[0][row[x]]++;
+            }
+        }
+
+        lock_guard<mutex> lock(mergeLock);
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += local[0][i] + local[1][i] + local[2][i] + local[3][i];
+        }
+    });
+}
+
+/*
+  histogram : 256-bin intensity histogram
+  lowCenter : output mean of the dark cluster
+  highCenter : output mean of the bright cluster
+
+  2-cluster k-means over the histogram bins. In 1-D the optimal 2-means
+  partition is a single cut, so scanning all 255 cuts (Otsu's between-class
+  variance) finds the global optimum in O(256) with no random seeding.
+  Returns the k-means decision boundary, the midpoint of the two centers.
+*/
+double histogramClusterCenters(const vector<int>& histogram, double& lowCenter, double& highCenter) {
+    double total = 0.0, totalSum = 0.0;
+    for (int i = 0; i < 256; i++) {
+        total += histogram[i];
+        totalSum += static_cast<double>(i) * histogram[i];
+    }
+    if (total == 0) {
+        lowCenter = highCenter = 0.0;
+        return 0.0;
+    }
+
+    double lowCount = 0.0, lowSum = 0.0;
+    double bestScore = -1.0;
+    lowCenter = highCenter = totalSum / total;
+
+    for (int cut = 0; cut < 255; cut++) {
+        lowCount += histogram[cut];
+        lowSum += static_cast<double>(cut) * histogram[cut];
+        double highCount = total - lowCount;
+        if (lowCount == 0 || highCount == 0) continue;
+
+        double lowMean = lowSum / lowCount;
+        double highMean = (totalSum - lowSum) / highCount;
+        double score = lowCount * highCount * (highMean - lowMean) * (highMean - lowMean);
+        if (score > bestScore) {
+            bestScore = score;
+            lowCenter = lowMean;
+            highCenter = highMean;
+        }
+    }
+
+    return (lowCenter + highCenter) / 2.0;
+}
+
+/*
+  histogram : 256-bin intensity histogram
+  lowCenter : dark cluster center, used as the starting point and updated
+  highCenter : bright cluster center, used as the starting point and updated
+  maxIterations : maximum number of k-means iterations over the bins
+
+  Lloyd k-means iterations over the histogram bins warm started from the
+  given centers, usually converging in one or two O(256) iterations when the
+  centers come from the previous frame. Falls back to the full search if a
+  cluster empties out. Returns the midpoint of the two centers.
+*/
+double refineClusterCenters(const vector<int>& histogram, double& lowCenter, double& highCenter,
+    int maxIterations) {
+    if (lowCenter > highCenter) {
+        swap(lowCenter, highCenter);
+    }
+
+    for (int iter = 0; iter < maxIterations; iter++) {
+        double boundary = (lowCenter + highCenter) / 2.0;
+        double lowCount = 0.0, lowSum = 0.0, highCount = 0.0, highSum = 0.0;
+        for (int i = 0; i < 256; i++) {
+            if (i <= boundary) {
+                lowCount += histogram[i];
+                lowSum += static_cast<double>(i) * histogram[i];
+            }
+            else {
+                highCount += histogram[i];
+                highSum += static_cast<double>(i) * histogram[i];
+            }
+        }
+        if (lowCount == 0 || highCount == 0) {
+            return histogramClusterCenters(histogram, lowCenter, highCenter);
+        }
+
+        double newLow = lowSum / lowCount;
+        double newHigh = highSum / highCount;
+        double shift = abs(newLow - lowCenter) + abs(newHigh - highCenter);
+        lowCenter = newLow;
+        highCenter = newHigh;
+        if (shift < 0.5) break;
+    }
+
+    return (lowCenter + highCenter) / 2.0;
+}
+
+/*
+  current : histogram of the current frame
+  reference : histogram the current threshold was computed from
+
+  Total variation distance between the two normalized histograms, 0 for
+  identical intensity distributions and 1 for completely disjoint ones.
+*/
+double histogramDrift(const vector<int>& current, const vector<int>& reference) {
+    if (current.size() != reference.size()) return 1.0;
+
+    double currentTotal = 0.0, referenceTotal = 0.0;
+    for (size_t i = 0; i < current.size(); i++) {
+        currentTotal += current[i];
+        referenceTotal += reference[i];
+    }
+    if (currentTotal == 0 || referenceTotal == 0) return 1.0;
+
+    double drift = 0.0;
+    for (size_t i = 0; i < current.size(); i++) {
+        drift += abs(current[i] / currentTotal - reference[i] / referenceTotal);
+    }
+    return drift / 2.0;
+}
+
 /*
   image : input image for threshold calculation
-  sampleFraction : fraction of total pixels to sample for k-means clustering
 
-  k-means clustering on randomly sampled pixels to determine the
-  binary threshold value by separating image into two clusters.
+  Determines the binary threshold value by separating the image into two
+  clusters, using a single histogram pass over every pixel.
 */
-double findOptimalThreshold(const Mat& image, int sampleFraction) {
+double findOptimalThreshold(const Mat& image) {
     Mat gray;
     if (image.channels() == 3) {
         cvtColor(image, gray, COLOR_BGR2GRAY);
     }
     else {
-        gray = image.clone();
+        gray = image;
     }
 
-    int totalPixels = gray.rows * gray.cols;
-    int sampleSize = totalPixels / sampleFraction;
-    vector<float> samples;
-    samples.reserve(sampleSize);
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_int_distribution<> dis(0, totalPixels - 1);
+    vector<int> histogram;
+    computeHistogram(gray, histogram);
+    double lowCenter, highCenter;
+    return histogramClusterCenters(histogram, lowCenter, highCenter);
+}
+
+/*
+  tracker : threshold state from previous frames
+  gray : single channel 8-bit image to threshold
+
+  Per-frame threshold selection for a mostly static scene. Only the histogram
+  pass runs while the drift from the last clustered histogram stays under
+  tolerance, otherwise the clusters are warm started from the previous
+  centers. Every refreshPeriod frames the search restarts from scratch.
+*/
+double trackThreshold(ThresholdTracker& tracker, const Mat& gray) {
+    vector<int> histogram;
+    computeHistogram(gray, histogram);
+    return trackThreshold(tracker, histogram);
+}
 
-    for (int i = 0; i < sampleSize; ++i) {
-        int idx = dis(gen);
-        int row = idx / gray.cols;
-        int col = idx % gray.cols;
-        samples.push_back(static_cast<float>(gray.at<uchar>(row, col)));
+/*
+  tracker : threshold state from previous frames
+  histogram : 256-bin histogram of the current frame's value plane
+
+  Same as above for callers that already gathered the histogram.
+*/
+double trackThreshold(ThresholdTracker& tracker, const vector<int>& histogram) {
+    bool refreshDue = !tracker.initialized || tracker.framesSinceRefresh >= tracker.refreshPeriod;
+    if (!refreshDue && histogramDrift(histogram, tracker.histogram) < tracker.driftTolerance) {
+        tracker.framesSinceRefresh++;
+        return tracker.threshold;
     }
 
-    Mat samplesMat(static_cast<int>(samples.size()), 1, CV_32F, samples.data());
-    Mat labels, centers;
-    kmeans(samplesMat, 2, labels, TermCriteria(TermCriteria::EPS + TermCriteria::MAX_ITER, 10, 1.0),
-        3, KMEANS_PP_CENTERS, centers);
-    float mean1 = centers.at<float>(0, 0);
-    float mean2 = centers.at<float>(1, 0);
-    return (min(mean1, mean2) + max(mean1, mean2)) / 2.0;
+    if (refreshDue) {
+        tracker.threshold = histogramClusterCenters(histogram, tracker.lowCenter, tracker.highCenter);
+        tracker.framesSinceRefresh = 0;
+    }
+    else {
+        tracker.threshold = refineClusterCenters(histogram, tracker.lowCenter, tracker.highCenter);
+        tracker.framesSinceRefresh++;
+    }
+    tracker.histogram = histogram;
+    tracker.initialized = true;
+
+    return tracker.threshold;
+}
+
+/*
+  Fixed point 5x5 Gaussian (sigma 1.5) taps, outer/inner/center, scaled so
+  one separable direction sums to 256.
+*/
+static void gaussianTaps(int taps[3]) {
+    Mat kernel = getGaussianKernel(5, 1.5, CV_64F);
+    taps[0] = cvRound(kernel.at<double>(0) * 256);
+    taps[1] = cvRound(kernel.at<double>(1) * 256);
+    taps[2] = 256 - 2 * taps[0] - 2 * taps[1];
+}
+
+/*
+  Reciprocal table for the 8-bit HSV saturation, (255 << 12) / v, the same
+  fixed point division cvtColor uses.
+*/
+static const int* saturationDivTable() {
+    static const vector<int> table = [] {
+        vector<int> t(256, 0);
+        for (int v = 1; v < 256; v++) {
+            t[v] = cvRound((255 << 12) / static_cast<double>(v));
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+/*
+  index : row or column index, may be up to 2 outside the image
+  size : number of rows or columns
+
+  BORDER_REFLECT_101 index mapping, the border GaussianBlur uses by default.
+*/
+static int reflectIndex(int index, int size) {
+    if (index < 0) return -index;
+    if (index >= size) return 2 * size - 2 - index;
+    return index;
+}
+
+/*
+  src : one row of the input frame, BGR or single channel
+  value : output row of per-pixel values
+  cols : row length in pixels
+  channels : 3 for BGR input, 1 for grayscale input
+  plane : which value to compute from BGR
+  divTable : saturation reciprocal table
+
+  Computes the value plane for one row straight from the frame. Written as
+  plain branch free loops so the compiler vectorizes them.
+*/
+static void computeValueRow(const uchar* src, uchar* value, int cols, int channels,
+    ValuePlane plane, const int* divTable) {
+    if (channels == 1) {
+        memcpy(value, src, cols);
+        return;
+    }
+
+    if (plane == VALUE_GRAY) {
+        // cvtColor BGR2GRAY coefficients, 14 bit fixed point
+        for (int x = 0; x < cols; x++) {
+            const uchar* p = src + 3 * x;
+            value[x] = static_cast<uchar>((p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + (1 << 13)) >> 14);
+        }
+    }
+    else {
+        // V = max, S = (max - min) * 255 / max, then 0.7 V + 0.3 S in 15 bit fixed point
+        for (int x = 0; x < cols; x++) {
+            const uchar* p = src + 3 * x;
+            int v = max(p[0], max(p[1], p[2]));
+            int minValue = min(p[0], min(p[1], p[2]));
+            int sat = ((v - minValue) * divTable[v] + (1 << 11)) >> 12;
+            value[x] = static_cast<uchar>((v * 22938 + sat * 9830 + (1 << 14)) >> 15);
+        }
+    }
+}
+
+/*
+  frame : color frame from video capture (CV_8UC3, or CV_8UC1 used as is)
+  plane : value plane to compute from the color pixels
+  provisionalThreshold : threshold to binarize with in the same pass, -1 to skip
+  blurred : output blurred value plane
+  binary : output packed mask, values above provisionalThreshold set
+  histogram : output 256-bin histogram of the blurred plane
+
+  Fused replacement for the cvtColor / split / addWeighted / GaussianBlur /
+  threshold chain. Row bands run in parallel, each one computes the value row
+  straight from BGR, blurs it horizontally into a 5 row rolling buffer, and
+  the vertical blur emits the blurred row, the packed mask row and the histogram
+  counts together, so the frame is read once and nothing full size is
+  allocated in between.
+*/
+void fusedValueBlur(const Mat& frame, ValuePlane plane, int provisionalThreshold,
+    Mat& blurred, BinaryMask& binary, vector<int>& histogram) {
+    CV_Assert((frame.type() == CV_8UC3 || frame.type() == CV_8UC1) && frame.rows >= 3 && frame.cols >= 3);
+    int rows = frame.rows, cols = frame.cols, channels = frame.channels();
+    bool emitBinary = provisionalThreshold >= 0;
+    blurred.create(rows, cols, CV_8UC1);
+    if (emitBinary) {
+        binary.create(rows, cols);
+    }
+    histogram.assign(256, 0);
+
+    const int* divTable = saturationDivTable();
+    int taps[3];
+    gaussianTaps(taps);
+    int bands = rowBandCount(rows);
+    mutex mergeLock;
+
+    parallel_for_(Range(0, bands), [&](const Range& bandRange) {
+        vector<uchar> padded(cols + 4);
+        vector<ushort> ring(5 * cols);
+        int local[256] = {};
+
+        // horizontal blur of (reflected) row virtualRow into its ring slot
+        auto blurRowIntoRing = [&](int virtualRow) {
+            uchar* p = padded.data();
+            computeValueRow(frame.ptr<uchar>(reflectIndex(virtualRow, rows)), p + 2, cols, channels, plane, divTable);
+            p[0] = p[4];
+            p[1] = p[3];
+            p[cols + 2] = p[cols];
+            p[cols + 3] = p[cols - 1];
+            ushort* out = &ring[((virtualRow + 5) % 5) * cols];
+            for (int x = 0; x < cols; x++) {
+                out[x] = static_cast<ushort>(taps[0] * (p[x] + p[x + 4]) + taps[1] * (p[x + 1] + p[x + 3]) + taps[2] * p[x + 2]);
+            }
+        };
+
+        for (int band = bandRange.start; band < bandRange.end; band++) {
+            int yStart = rows * band / bands;
+            int yEnd = rows * (band + 1) / bands;
+            for (int v = yStart - 2; v < yStart + 2; v++) {
+                blurRowIntoRing(v);
+            }
+
+            for (int y = yStart; y < yEnd; y++) {
+                blurRowIntoRing(y + 2);
+                const ushort* r0 = &ring[((y + 3) % 5) * cols];
+                const ushort* r1 = &ring[((y + 4) % 5) * cols];
+                const ushort* r2 = &ring[(y % 5) * cols];
+                const ushort* r3 = &ring[((y + 1) % 5) * cols];
+                const ushort* r4 = &ring[((y + 2) % 5) * cols];
+
+                uchar* dst = blurred.ptr<uchar>(y);
+                for (int x = 0; x < cols; x++) {
+                    dst[x] = static_cast<uchar>((taps[0] * (r0[x] + r4[x]) + taps[1] * (r1[x] + r3[x]) +
+                        taps[2] * r2[x] + (1 << 15)) >> 16);
+                }
+                if (emitBinary) {
+                    binary.packRow(y, dst, provisionalThreshold);
+                }
+                for (int x = 0; x < cols; x++) {
+                    local[dst[x]]++;
+                }
+            }
+        }
+
+        lock_guard<mutex> lock(mergeLock);
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += local[i];
+        }
+    });
+}
+
+/*
+  frame : color frame from video capture
+  plane : value plane to threshold
+  tracker : optional threshold state shared across frames
+  mask : output packed mask, set where the value is above the threshold
+
+  Runs the fused kernel binarizing with the tracker's current threshold, and
+  only re-binarizes the blurred plane if this frame's histogram moved the
+  threshold, so a static scene costs a single pass over the frame.
+*/
+static void fusedThreshold(const Mat& frame, ValuePlane plane, ThresholdTracker* tracker, BinaryMask& mask) {
+    Mat blurred;
+    vector<int> histogram;
+    int provisional = (tracker && tracker->initialized) ? cvFloor(tracker->threshold) : -1;
+    fusedValueBlur(frame, plane, provisional, blurred, mask, histogram);
+
+    double thresholdValue;
+    if (tracker) {
+        thresholdValue = trackThreshold(*tracker, histogram);
+    }
+    else {
+        double lowCenter, highCenter;
+        thresholdValue = histogramClusterCenters(histogram, lowCenter, highCenter);
+    }
+
+    int finalThreshold = cvFloor(thresholdValue);
+    if (finalThreshold != provisional) {
+        mask.create(blurred.rows, blurred.cols);
+        parallel_for_(Range(0, blurred.rows), [&](const Range& range) {
+            for (int y = range.start; y < range.end; y++) {
+                mask.packRow(y, blurred.ptr<uchar>(y), finalThreshold);
+            }
+        });
+    }
 }
 
 /*
   frame : color frame from video capture
+  mask : output packed mask
+  tracker : optional threshold state shared across frames
 
   Converts image to grayscale and applies thresholding.
 */
-Mat grayscaleThreshold(const Mat& frame) {
-    Mat gray, blurred, result;
-    cvtColor(frame, gray, COLOR_BGR2GRAY);
-    GaussianBlur(gray, blurred, Size(5, 5), 1.5);
-    double thresholdValue = findOptimalThreshold(blurred);
-    threshold(blurred, result, thresholdValue, 255, THRESH_BINARY);
-    return result;
+void grayscaleThreshold(const Mat& frame, BinaryMask& mask, ThresholdTracker* tracker) {
+    fusedThreshold(frame, VALUE_GRAY, tracker, mask);
 }
 
 /*
   frame : color frame from video capture
+  mask : output packed mask
+  tracker : optional threshold state shared across frames
 
   Uses HSV color space combination of saturation and value channels 
   for segmentation of colored objects against background.
 */
-Mat customThreshold(const Mat& frame) {
-    Mat hsv, saturation, value, result;
-    cvtColor(frame, hsv, COLOR_BGR2HSV);
-    vector<Mat> hsvChannels;
-    split(hsv, hsvChannels);
-    saturation = hsvChannels[1];
-    value = hsvChannels[2];
-    Mat combined;
-    addWeighted(value, 0.7, saturation, 0.3, 0, combined, CV_8U);
+void customThreshold(const Mat& frame, BinaryMask& mask, ThresholdTracker* tracker) {
+    fusedThreshold(frame, VALUE_WEIGHTED_SV, tracker, mask);
+}
+
+/*
+  frame : color frame from video capture
+  tracker : optional threshold state shared across frames
+
+  8-bit versions of the thresholders above, for display and older callers.
+*/
+Mat grayscaleThreshold(const Mat& frame, ThresholdTracker* tracker) {
+    BinaryMask mask;
+    Mat result;
+    grayscaleThreshold(frame, mask, tracker);
+    mask.toMat(result);
+    return result;
+}
+
+Mat customThreshold(const Mat& frame, ThresholdTracker* tracker) {
+    BinaryMask mask;
+    Mat result;
+    customThreshold(frame, mask, tracker);
+    mask.toMat(result);
+    return result;
+}
+
+/*
+  frame : color frame from video capture
+  mask : output packed mask
+  tileGrid : number of tiles across and down the frame
+  minContrast : minimum distance between a tile's two cluster centers for
+    the tile to get its own threshold
+
+  Local thresholding for uneven illumination. Each tile computes its own
+  histogram threshold in parallel. Tiles without enough contrast to be
+  bimodal take the average of their neighbours' thresholds, or the global
+  threshold if nothing around them is bimodal. The per-tile thresholds are
+  then bilinearly interpolated between tile centers for every pixel.
+*/
+void adaptiveTileThreshold(const Mat& frame, BinaryMask& mask, Size tileGrid, double minContrast) {
     Mat blurred;
-    GaussianBlur(combined, blurred, Size(5, 5), 1.5);
-    double thresholdValue = findOptimalThreshold(blurred);
-    threshold(blurred, result, thresholdValue, 255, THRESH_BINARY);
+    BinaryMask unused;
+    vector<int> globalHistogram;
+    fusedValueBlur(frame, VALUE_GRAY, -1, blurred, unused, globalHistogram);
+    double lowCenter, highCenter;
+    double globalThreshold = histogramClusterCenters(globalHistogram, lowCenter, highCenter);
+
+    int tilesX = max(1, min(tileGrid.width, blurred.cols));
+    int tilesY = max(1, min(tileGrid.height, blurred.rows));
+    int tileCount = tilesX * tilesY;
+    vector<double> tileThresholds(tileCount, globalThreshold);
+    vector<char> tileValid(tileCount, 0);
+
+    parallel_for_(Range(0, tileCount), [&](const Range& range) {
+        vector<int> histogram;
+        for (int t = range.start; t < range.end; t++) {
+            int tx = t % tilesX, ty = t / tilesX;
+            int x0 = blurred.cols * tx / tilesX, x1 = blurred.cols * (tx + 1) / tilesX;
+            int y0 = blurred.rows * ty / tilesY, y1 = blurred.rows * (ty + 1) / tilesY;
+
+            histogram.assign(256, 0);
+            for (int y = y0; y < y1; y++) {
+                const uchar* row = blurred.ptr<uchar>(y);
+                for (int x = x0; x < x1; x++) {
+                    histogram[row[x]]++;
+                }
+            }
+
+            double low, high;
+            double tileThreshold = histogramClusterCenters(histogram, low, high);
+            if (high - low >= minContrast) {
+                tileThresholds[t] = tileThreshold;
+                tileValid[t] = 1;
+            }
+        }
+    });
+
+    // spread thresholds from bimodal tiles into flat ones, one ring at a time
+    bool anyValid = find(tileValid.begin(), tileValid.end(), 1) != tileValid.end();
+    while (anyValid && find(tileValid.begin(), tileValid.end(), 0) != tileValid.end()) {
+        vector<char> nextValid = tileValid;
+        for (int t = 0; t < tileCount; t++) {
+            if (tileValid[t]) continue;
+            int tx = t % tilesX, ty = t / tilesX;
+            double sum = 0.0;
+            int count = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = tx + dx, ny = ty + dy;
+                    if (nx < 0 || ny < 0 || nx >= tilesX || ny >= tilesY) continue;
+                    int n = ny * tilesX + nx;
+                    if (tileValid[n]) {
+                        sum += tileThresholds[n];
+                        count++;
+                    }
+                }
+            }
+            if (count > 0) {
+                tileThresholds[t] = sum / count;
+                nextValid[t] = 1;
+            }
+        }
+        tileValid.swap(nextValid);
+    }
+
+    // per column tile pair and weight for interpolating between tile centers
+    vector<int> colTile0(blurred.cols), colTile1(blurred.cols);
+    vector<float> colWeight(blurred.cols);
+    float tileWidth = blurred.cols / static_cast<float>(tilesX);
+    for (int x = 0; x < blurred.cols; x++) {
+        float fx = min(max((x + 0.5f) / tileWidth - 0.5f, 0.0f), static_cast<float>(tilesX - 1));
+        colTile0[x] = static_cast<int>(fx);
+        colTile1[x] = min(colTile0[x] + 1, tilesX - 1);
+        colWeight[x] = fx - colTile0[x];
+    }
+
+    mask.create(blurred.rows, blurred.cols);
+    float tileHeight = blurred.rows / static_cast<float>(tilesY);
+
+    parallel_for_(Range(0, blurred.rows), [&](const Range& range) {
+        vector<float> rowThresholds(tilesX);
+        vector<uchar> rowValues(blurred.cols);
+        for (int y = range.start; y < range.end; y++) {
+            float fy = min(max((y + 0.5f) / tileHeight - 0.5f, 0.0f), static_cast<float>(tilesY - 1));
+            int ty0 = static_cast<int>(fy);
+            int ty1 = min(ty0 + 1, tilesY - 1);
+            float wy = fy - ty0;
+            for (int tx = 0; tx < tilesX; tx++) {
+                rowThresholds[tx] = static_cast<float>((1 - wy) * tileThresholds[ty0 * tilesX + tx] +
+                    wy * tileThresholds[ty1 * tilesX + tx]);
+            }
+
+            const uchar* src = blurred.ptr<uchar>(y);
+            uchar* dst = rowValues.data();
+            for (int x = 0; x < blurred.cols; x++) {
+                float localThreshold = (1 - colWeight[x]) * rowThresholds[colTile0[x]] +
+                    colWeight[x] * rowThresholds[colTile1[x]];
+                dst[x] = src[x] > localThreshold ? 255 : 0;
+            }
+            mask.packRow(y, dst, 0);
+        }
+    });
+}
+
+/*
+  frame : color frame from video capture
+  tileGrid : number of tiles across and down the frame
+  minContrast : minimum cluster separation for a tile to get its own threshold
+
+  8-bit version of adaptiveTileThreshold above.
+*/
+Mat adaptiveTileThreshold(const Mat& frame, Size tileGrid, double minContrast) {
+    BinaryMask mask;
+    Mat result;
+    adaptiveTileThreshold(frame, mask, tileGrid, minContrast);
+    mask.toMat(result);
     return result;
 }
\ No newline at end of file
@@ -8,9 +8,50 @@
 #define THRESHOLDING_H
 
 #include <opencv2/opencv.hpp>
+#include <vector>
+#include "binaryMask.h"
 
-double findOptimalThreshold(const cv::Mat& image, int sampleFraction = 16);
-cv::Mat grayscaleThreshold(const cv::Mat& frame);
-cv::Mat customThreshold(const cv::Mat& frame);
+/*
+  Per-pixel value plane the fused kernel thresholds: BGR luminance, or the
+  0.7 V + 0.3 S combination from HSV used by the custom mode.
+*/
+enum ValuePlane {
+    VALUE_GRAY,
+    VALUE_WEIGHTED_SV
+};
+
+/*
+  Threshold state carried between frames: the cluster centers and histogram
+  from the last clustering run, so later frames can warm start from those
+  centers or skip clustering entirely while the scene is unchanged.
+*/
+struct ThresholdTracker {
+    bool initialized = false;
+    double lowCenter = 0.0;
+    double highCenter = 0.0;
+    double threshold = 0.0;
+    std::vector<int> histogram;
+    int framesSinceRefresh = 0;
+    double driftTolerance = 0.02;
+    int refreshPeriod = 30;
+};
+
+void computeHistogram(const cv::Mat& gray, std::vector<int>& histogram);
+double histogramClusterCenters(const std::vector<int>& histogram, double& lowCenter, double& highCenter);
+double refineClusterCenters(const std::vector<int>& histogram, double& lowCenter, double& highCenter,
+    int maxIterations = 10);
+double histogramDrift(const std::vector<int>& current, const std::vector<int>& reference);
+double findOptimalThreshold(const cv::Mat& image);
+double trackThreshold(ThresholdTracker& tracker, const std::vector<int>& histogram);
+double trackThreshold(ThresholdTracker& tracker, const cv::Mat& gray);
+void fusedValueBlur(const cv::Mat& frame, ValuePlane plane, int provisionalThreshold,
+    cv::Mat& blurred, BinaryMask& binary, std::vector<int>& histogram);
+void grayscaleThreshold(const cv::Mat& frame, BinaryMask& mask, ThresholdTracker* tracker = nullptr);
+void customThreshold(const cv::Mat& frame, BinaryMask& mask, ThresholdTracker* tracker = nullptr);
+void adaptiveTileThreshold(const cv::Mat& frame, BinaryMask& mask, cv::Size tileGrid = cv::Size(8, 6),
+    double minContrast = 20.0);
+cv::Mat grayscaleThreshold(const cv::Mat& frame, ThresholdTracker* tracker = nullptr);
+cv::Mat customThreshold(const cv::Mat& frame, ThresholdTracker* tracker = nullptr);
+cv::Mat adaptiveTileThreshold(const cv::Mat& frame, cv::Size tileGrid = cv::Size(8, 6), double minContrast = 20.0);
 
-#endif
\ No newline at end of file
+#endif
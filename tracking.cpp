@@ -0,0 +1,182 @@
+/*
+  Nihal Sandadi
+
+  Implementation of region tracking with greedy overlap and distance
+  association and per track caching of CNN embeddings.
+*/
+
+#include "tracking.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+/*
+  a : first box
+  b : second box
+
+  Intersection over union of two axis aligned boxes.
+*/
+static float boxIoU(const Rect& a, const Rect& b) {
+    int intersection = (a & b).area();
+    int combined = a.area() + b.area() - intersection;
+    return (combined > 0) ? static_cast<float>(intersection) / combined : 0.0f;
+}
+
+/*
+  box : oriented box from minAreaRect
+
+  Angle of the box's long side in degrees within [0, 180). minAreaRect may
+  report the same box with width and height swapped and the angle shifted by
+  90, this removes that ambiguity.
+*/
+static float longAxisAngle(const RotatedRect& box) {
+    float angle = (box.size.width >= box.size.height) ? box.angle : box.angle + 90.0f;
+    angle = fmod(angle, 180.0f);
+    return (angle < 0) ? angle + 180.0f : angle;
+}
+
+/*
+  tracker : tracks from the previous frame, updated in place
+  regions : regions found in the current frame
+  features : features of each region, in the same order
+
+  Associates the current regions with the existing tracks and returns the
+  index into tracker.tracks for each region. Every region/track pair that
+  overlaps or is close enough is scored by overlap plus closeness and the
+  pairs are taken greedily best first, which with a handful of objects on
+  the table gives the same answer as an optimal assignment. Unmatched regions
+  start new tracks, unmatched tracks age and are dropped after
+  maxMissedFrames.
+*/
+vector<int> updateTracks(RegionTracker& tracker, const vector<Region>& regions,
+    const vector<RegionFeatures>& features) {
+
+    struct Candidate {
+        float score;
+        int region;
+        int track;
+    };
+
+    vector<Candidate> candidates;
+    for (int r = 0; r < static_cast<int>(regions.size()); r++) {
+        Point2f centroid(features[r].centroidX, features[r].centroidY);
+        for (int t = 0; t < static_cast<int>(tracker.tracks.size()); t++) {
+            const Track& track = tracker.tracks[t];
+            float iou = boxIoU(regions[r].boundingBox, track.boundingBox);
+            Point2f previous(track.features.centroidX, track.features.centroidY);
+            float distance = static_cast<float>(norm(centroid - previous));
+            if (iou < tracker.minIoU && distance > tracker.maxCentroidJump) {
+                continue;
+            }
+            float closeness = max(0.0f, 1.0f - distance / tracker.maxCentroidJump);
+            candidates.push_back({ iou + closeness, r, t });
+        }
+    }
+    sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.score > b.score;
+    });
+
+    vector<int> regionToTrack(regions.size(), -1);
+    vector<bool> trackMatched(tracker.tracks.size(), false);
+    for (const auto& candidate : candidates) {
+        if (regionToTrack[candidate.region] != -1 || trackMatched[candidate.track]) {
+            continue;
+        }
+        regionToTrack[candidate.region] = candidate.track;
+        trackMatched[candidate.track] = true;
+    }
+
+    // matched tracks take the new observation, the rest age out
+    vector<Track> survivors;
+    survivors.reserve(tracker.tracks.size() + regions.size());
+    vector<int> oldToNew(tracker.tracks.size(), -1);
+    for (int t = 0; t < static_cast<int>(tracker.tracks.size()); t++) {
+        Track& track = tracker.tracks[t];
+        track.framesSinceEmbedding++;
+        if (trackMatched[t]) {
+            track.missedFrames = 0;
+        }
+        else if (++track.missedFrames > tracker.maxMissedFrames) {
+            continue;
+        }
+        oldToNew[t] = survivors.size();
+        survivors.push_back(std::move(track));
+    }
+
+    for (int r = 0; r < static_cast<int>(regions.size()); r++) {
+        int index;
+        if (regionToTrack[r] != -1) {
+            index = oldToNew[regionToTrack[r]];
+        }
+        else {
+            Track track;
+            track.id = tracker.nextId++;
+            index = survivors.size();
+            survivors.push_back(std::move(track));
+        }
+        Track& track = survivors[index];
+        track.features = features[r];
+        track.boundingBox = regions[r].boundingBox;
+        track.age++;
+        regionToTrack[r] = index;
+    }
+
+    tracker.tracks = std::move(survivors);
+    return regionToTrack;
+}
+
+/*
+  tracker : tracker holding the cache tolerances
+  track : track to check
+
+  Whether the track's cached embedding can't be reused for its current
+  position: there is none yet, the object has moved, turned or changed size
+  past the tolerances since it was taken, or it is too old. Never true while
+  an embedding for the track is still being computed.
+*/
+bool needsEmbedding(const RegionTracker& tracker, const Track& track) {
+    if (track.embeddingPending) {
+        return false;
+    }
+    if (!track.hasEmbedding || track.framesSinceEmbedding >= tracker.staleFrames) {
+        return true;
+    }
+
+    const RotatedRect& current = track.features.orientedBoundingBox;
+    const RotatedRect& cached = track.embeddedBox;
+    if (norm(current.center - cached.center) > tracker.moveTolerance) {
+        return true;
+    }
+
+    float turn = fabs(longAxisAngle(current) - longAxisAngle(cached));
+    if (min(turn, 180.0f - turn) > tracker.rotateTolerance) {
+        return true;
+    }
+
+    float currentArea = current.size.area();
+    float cachedArea = cached.size.area();
+    return fabs(currentArea - cachedArea) > tracker.sizeTolerance * max(cachedArea, 1.0f);
+}
+
+/*
+  track : track the embedding was computed for
+  embedding : CNN embedding of the track's current crop, the track's previous buffer on return
+  box : oriented box of the crop the embedding was computed from
+
+  Caches the embedding along with the box it was taken from, swapping it
+  in rather than copying it. The box can be a few frames old when the
+  embedding was computed asynchronously. The CNN result is marked out of
+  date so it is reclassified against the training set.
+*/
+void storeEmbedding(Track& track, vector<float>& embedding, const RotatedRect& box) {
+    track.embedding.swap(embedding);
+    track.embeddedBox = box;
+    track.embeddingPending = false;
+    track.hasEmbedding = true;
+    track.framesSinceEmbedding = 0;
+    track.classifiedRevision = -1;
+}
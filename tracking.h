@@ -0,0 +1,67 @@
+/*
+  Nihal Sandadi
+
+  Header file for frame to frame region tracking, giving each object a stable
+  id and caching its CNN embedding and classification between frames.
+*/
+
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "regionAnalysis.h"
+#include "regionFeatures.h"
+#include "classification.h"
+
+/*
+  One tracked object: its latest features, plus the embedding and CNN result
+  from the last time the network was run on it. embeddedBox is the oriented
+  box the embedding was taken from, used to tell when the object has moved
+  or rotated enough to need a new one. embeddingPending is set while a new
+  embedding is being computed for the track. classifiedRevision is the
+  training set revision the cached CNN result was computed against, and
+  cnnCandidates the labels it was restricted to, empty for all of them.
+*/
+struct Track {
+    int id = 0;
+    RegionFeatures features;
+    cv::Rect boundingBox;
+    int age = 0;
+    int missedFrames = 0;
+    bool hasEmbedding = false;
+    bool embeddingPending = false;
+    std::vector<float> embedding;
+    cv::RotatedRect embeddedBox;
+    int framesSinceEmbedding = 0;
+    int classifiedRevision = -1;
+    std::vector<std::string> cnnCandidates;
+    ClassificationResult cnnResult;
+};
+
+/*
+  Live tracks and the association and cache settings. A region matches a
+  track when their boxes overlap by minIoU or their centroids are within
+  maxCentroidJump pixels. Tracks unseen for more than maxMissedFrames are
+  dropped. A cached embedding is reused until the object moves more than
+  moveTolerance pixels, turns more than rotateTolerance degrees, changes
+  size by more than sizeTolerance, or is staleFrames frames old.
+*/
+struct RegionTracker {
+    std::vector<Track> tracks;
+    int nextId = 1;
+    float minIoU = 0.3f;
+    float maxCentroidJump = 40.0f;
+    int maxMissedFrames = 5;
+    float moveTolerance = 4.0f;
+    float rotateTolerance = 5.0f;
+    float sizeTolerance = 0.1f;
+    int staleFrames = 90;
+};
+
+std::vector<int> updateTracks(RegionTracker& tracker, const std::vector<Region>& regions,
+    const std::vector<RegionFeatures>& features);
+bool needsEmbedding(const RegionTracker& tracker, const Track& track);
+void storeEmbedding(Track& track, std::vector<float>& embedding, const cv::RotatedRect& box);
+
+#endif
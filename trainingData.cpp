@@ -134,6 +134,123 @@ bool saveTrainingData(const vector<TrainingSample>& samples, const string& filen
     }
 }
 
+/*
+  text : JSON text
+  position : index just past a string's opening quote, moved past its closing quote
+  value : output, the unescaped string
+
+  Reads one JSON string as written by escapeJsonString. Returns false if the
+  text ends before the closing quote.
+*/
+static bool readJsonString(const string& text, size_t& position, string& value) {
+    value.clear();
+    while (position < text.size() && text[position] != '"') {
+        char c = text[position++];
+        if (c == '\\' && position < text.size()) {
+            char escaped = text[position++];
+            switch (escaped) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            default: c = escaped; break;
+            }
+        }
+        value += c;
+    }
+    if (position >= text.size()) {
+        return false;
+    }
+    position++;
+    return true;
+}
+
+/*
+  text : JSON text
+  position : where to start looking, moved past the array
+  key : name of the array
+  values : output, its numbers
+
+  Finds "key": [ ... ] from position on and reads the numbers in it.
+  Returns false if the key or the closing bracket is missing.
+*/
+template <typename T>
+static bool readJsonArray(const string& text, size_t& position, const string& key, vector<T>& values) {
+    values.clear();
+    size_t found = text.find("\"" + key + "\"", position);
+    size_t open = (found == string::npos) ? string::npos : text.find('[', found);
+    size_t close = (open == string::npos) ? string::npos : text.find(']', open);
+    if (close == string::npos) {
+        return false;
+    }
+
+    const char* cursor = text.c_str() + open + 1;
+    const char* end = text.c_str() + close;
+    while (cursor < end) {
+        char* next;
+        double value = strtod(cursor, &next);
+        if (next == cursor) {
+            cursor++;
+            continue;
+        }
+        values.push_back(static_cast<T>(value));
+        cursor = next;
+    }
+    position = close + 1;
+    return true;
+}
+
+/*
+  samples : output, the training samples in the file
+  filename : JSON file written by saveTrainingData
+
+  Reads the training data back, replacing whatever samples held. Returns
+  false, leaving samples empty, if the file can't be opened or a sample in
+  it is incomplete.
+*/
+bool loadTrainingData(vector<TrainingSample>& samples, const string& filename) {
+    samples.clear();
+    ifstream file(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    const string text = contents.str();
+
+    size_t position = text.find("\"samples\"");
+    if (position == string::npos) {
+        cerr << "Error: no samples in training data file: " << filename << endl;
+        return false;
+    }
+
+    const string labelKey = "\"label\": \"";
+    const string timestampKey = "\"timestamp\": \"";
+    while ((position = text.find(labelKey, position)) != string::npos) {
+        TrainingSample sample;
+        position += labelKey.size();
+        bool complete = readJsonString(text, position, sample.label);
+
+        size_t timestamp = text.find(timestampKey, position);
+        if (complete && timestamp != string::npos) {
+            position = timestamp + timestampKey.size();
+            complete = readJsonString(text, position, sample.timestamp);
+        }
+        complete = complete && readJsonArray(text, position, "features", sample.features) &&
+            readJsonArray(text, position, "cnn_embedding", sample.cnnEmbedding);
+        if (!complete) {
+            cerr << "Error: incomplete sample in training data file: " << filename << endl;
+            samples.clear();
+            return false;
+        }
+        samples.push_back(sample);
+    }
+
+    cout << "Loaded " << samples.size() << " training samples from: " << filename << endl;
+    return true;
+}
+
 /*
   image : output image for status display
   samples : collection of training samples
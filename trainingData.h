@@ -25,6 +25,7 @@ struct TrainingSample {
 };
 
 bool saveTrainingData(const std::vector<TrainingSample>& samples, const std::string& filename);
+bool loadTrainingData(std::vector<TrainingSample>& samples, const std::string& filename);
 TrainingSample createTrainingSample(const std::string& label, const RegionFeatures& features);
 void displayTrainingStatus(cv::Mat& image, const std::vector<TrainingSample>& samples, bool waitingForInput = false);
 
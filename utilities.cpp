@@ -129,4 +129,72 @@ void prepEmbeddingImage(cv::Mat& frame, cv::Mat& embimage, int cx, int cy, float
 
 
     return;
-}
\ No newline at end of file
+}
+
+
+/*
+  Same region as prepEmbeddingImage, but sampled straight into the network
+  input instead of rotating the whole frame and cropping.
+
+  cv::Mat &frame - the original image
+  cv::Mat &netimage - the resulting size x size image, reused without reallocating if it already has that size and type
+  int cx, cy, float theta, minE1, maxE1, minE2, maxE2 - the oriented bounding box, as for prepEmbeddingImage
+  int size - the network input size
+  int debug - whether to show the result
+
+  The rotation about the centroid, the crop and the resize to size x size
+  are folded into one affine transform from the output pixels back to the
+  frame, so a single small warpAffine replaces the warp of the whole frame
+  (about 905x905 for a 640x480 camera) and the two resizes after it. The
+  2 pixel border prepEmbeddingImage draws around the crop is drawn scaled on
+  the output, so embeddings stay comparable with the stored training set.
+*/
+void prepEmbeddingInput(cv::Mat& frame, cv::Mat& netimage, int cx, int cy, float theta, float minE1, float maxE1, float minE2, float maxE2, int size, int debug) {
+
+    // same crop rectangle as prepEmbeddingImage, in the rotated image
+    int left = cx + (int)minE1;
+    int top = cy - (int)maxE2;
+    int width = (int)maxE1 - (int)minE1;
+    int height = (int)maxE2 - (int)minE2;
+    if (width < 1) {
+        width = 1;
+    }
+    if (height < 1) {
+        height = 1;
+    }
+    double sx = (double)width / size;
+    double sy = (double)height / size;
+
+    // rotated image -> frame
+    cv::Mat M = cv::getRotationMatrix2D(cv::Point2f(cx, cy), -theta * 180 / M_PI, 1.0);
+    cv::Mat Minv;
+    cv::invertAffineTransform(M, Minv);
+
+    // output pixel -> rotated image, matching cv::resize's pixel center convention
+    double ox = left + 0.5 * sx - 0.5;
+    double oy = top + 0.5 * sy - 0.5;
+
+    cv::Mat A(2, 3, CV_64F);
+    for (int r = 0; r < 2; r++) {
+        A.at<double>(r, 0) = Minv.at<double>(r, 0) * sx;
+        A.at<double>(r, 1) = Minv.at<double>(r, 1) * sy;
+        A.at<double>(r, 2) = Minv.at<double>(r, 0) * ox + Minv.at<double>(r, 1) * oy + Minv.at<double>(r, 2);
+    }
+
+    cv::warpAffine(frame, netimage, A, cv::Size(size, size), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP);
+
+    // the border prepEmbeddingImage's rectangle leaves inside the crop
+    int bx = std::max(1, cvRound(2 / sx));
+    int by = std::max(1, cvRound(2 / sy));
+    cv::rectangle(netimage, cv::Rect(0, 0, size, by), 200, cv::FILLED);
+    cv::rectangle(netimage, cv::Rect(0, size - by, size, by), 200, cv::FILLED);
+    cv::rectangle(netimage, cv::Rect(0, 0, bx, size), 200, cv::FILLED);
+    cv::rectangle(netimage, cv::Rect(size - bx, 0, bx, size), 200, cv::FILLED);
+
+    if (debug) {
+        printf("ROI box: %d %d %d %d\n", left, top, width, height);
+        cv::imshow("extracted", netimage);
+    }
+
+    return;
+}
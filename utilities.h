@@ -11,6 +11,12 @@ void prepEmbeddingImage(cv::Mat& frame, cv::Mat& embimage,
     float minE1, float maxE1, float minE2, float maxE2,
     int debug = 0);
 
+// Function to sample the same region straight into a size x size network input with one warp
+void prepEmbeddingInput(cv::Mat& frame, cv::Mat& netimage,
+    int cx, int cy, float theta,
+    float minE1, float maxE1, float minE2, float maxE2,
+    int size = 224, int debug = 0);
+
 // Function to get CNN embedding from prepared image
 int getEmbedding(cv::Mat& src, cv::Mat& embedding,
     cv::dnn::Net& net, int debug = 0);